@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define CHECKPOINT_MAGIC 0x57545045 // "WTPE"; bumped whenever the layout changes
+#define CHECKPOINT_MAX_ENTRIES (1 << 24) // sanity bound on bitmap bytes and marks
+
+// Receiver progress within one resumable transfer, in 64-bit packet numbers
+// (see ReceiveWindow.hpp), which never wrap. expectedSeq is one past the
+// highest contiguous packet; bit i of bitmap is set when expectedSeq + i has
+// already been received out of order.
+struct ResumeState {
+    uint64_t expectedSeq = 0;
+    std::vector<uint8_t> bitmap;
+
+    bool received(uint64_t seq) const {
+        if (seq < expectedSeq)
+            return true;
+        uint64_t bit = seq - expectedSeq;
+        return bit / 8 < bitmap.size() && (bitmap[bit / 8] >> (bit % 8)) & 1;
+    }
+
+    void mark(uint64_t seq) {
+        uint64_t bit = seq - expectedSeq;
+        if (bit / 8 >= bitmap.size())
+            bitmap.resize(bit / 8 + 1, 0);
+        bitmap[bit / 8] |= 1 << (bit % 8);
+    }
+};
+
+#define RESUME_STATE_HEADER_SIZE (sizeof(uint64_t) + sizeof(uint32_t))
+
+// Progress as carried in the ACK for a START with options, after the accepted
+// flags: uint64_t expectedSeq, uint32_t bitmap length in bytes, then the
+// bitmap, truncated to maxBytes in total. A truncated bitmap only means the
+// sender resends packets the receiver already has.
+inline void encodeResumeState(const ResumeState &state, std::vector<char> &out, size_t maxBytes) {
+    uint32_t bitmapBytes = state.bitmap.size();
+    if (bitmapBytes > maxBytes - RESUME_STATE_HEADER_SIZE)
+        bitmapBytes = maxBytes - RESUME_STATE_HEADER_SIZE;
+    out.resize(RESUME_STATE_HEADER_SIZE + bitmapBytes);
+    memcpy(out.data(), &state.expectedSeq, sizeof(uint64_t));
+    memcpy(out.data() + sizeof(uint64_t), &bitmapBytes, sizeof(uint32_t));
+    if (bitmapBytes)
+        memcpy(out.data() + RESUME_STATE_HEADER_SIZE, state.bitmap.data(), bitmapBytes);
+}
+
+inline bool decodeResumeState(const char *buf, size_t len, ResumeState &state) {
+    uint32_t bitmapBytes;
+    if (len < RESUME_STATE_HEADER_SIZE)
+        return false;
+    memcpy(&state.expectedSeq, buf, sizeof(uint64_t));
+    memcpy(&bitmapBytes, buf + sizeof(uint64_t), sizeof(uint32_t));
+    if (bitmapBytes > len - RESUME_STATE_HEADER_SIZE)
+        return false;
+    state.bitmap.assign(buf + RESUME_STATE_HEADER_SIZE, buf + RESUME_STATE_HEADER_SIZE + bitmapBytes);
+    return true;
+}
+
+// A packet received out of order whose length is not implied by the bitmap:
+// an EOF boundary or the short last DATA packet of a file
+struct SegmentMark {
+    uint64_t seqNum;
+    uint32_t type;
+    uint32_t length;
+};
+
+// Everything wReceiverOpt needs to pick a transfer back up after a restart
+struct Checkpoint {
+    uint32_t transferId = 0;
+    uint32_t fileCount = 0;    // i of the FILE-i.out being received
+    uint64_t fileStartSeq = 0; // packet number of its first DATA packet
+    uint64_t fileBytes = 0;    // bytes of it delivered in order so far
+    uint32_t flags = 0;        // START option flags of the transfer
+    uint32_t blockOpen = 0;    // a compressed block is partly delivered...
+    uint64_t blockStartSeq = 0; // ...starting at this packet number
+    ResumeState state;
+    std::vector<SegmentMark> marks;
+};
+
+// Written to a temporary file and renamed over the old checkpoint, so a crash
+// mid-write leaves the previous checkpoint intact
+inline bool saveCheckpoint(const std::string &path, const Checkpoint &ckpt) {
+    std::string tmpPath = path + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return false;
+    uint32_t magic = CHECKPOINT_MAGIC;
+    uint32_t bitmapBytes = ckpt.state.bitmap.size();
+    uint32_t markCount = ckpt.marks.size();
+    out.write((const char *)&magic, sizeof(magic));
+    out.write((const char *)&ckpt.transferId, sizeof(ckpt.transferId));
+    out.write((const char *)&ckpt.fileCount, sizeof(ckpt.fileCount));
+    out.write((const char *)&ckpt.fileStartSeq, sizeof(ckpt.fileStartSeq));
+    out.write((const char *)&ckpt.fileBytes, sizeof(ckpt.fileBytes));
+    out.write((const char *)&ckpt.flags, sizeof(ckpt.flags));
+    out.write((const char *)&ckpt.blockOpen, sizeof(ckpt.blockOpen));
+    out.write((const char *)&ckpt.blockStartSeq, sizeof(ckpt.blockStartSeq));
+    out.write((const char *)&ckpt.state.expectedSeq, sizeof(ckpt.state.expectedSeq));
+    out.write((const char *)&bitmapBytes, sizeof(bitmapBytes));
+    out.write((const char *)ckpt.state.bitmap.data(), bitmapBytes);
+    out.write((const char *)&markCount, sizeof(markCount));
+    out.write((const char *)ckpt.marks.data(), markCount * sizeof(SegmentMark));
+    out.close();
+    if (!out)
+        return false;
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+inline bool loadCheckpoint(const std::string &path, Checkpoint &ckpt) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+    uint32_t magic = 0, bitmapBytes = 0, markCount = 0;
+    in.read((char *)&magic, sizeof(magic));
+    if (!in || magic != CHECKPOINT_MAGIC)
+        return false;
+    in.read((char *)&ckpt.transferId, sizeof(ckpt.transferId));
+    in.read((char *)&ckpt.fileCount, sizeof(ckpt.fileCount));
+    in.read((char *)&ckpt.fileStartSeq, sizeof(ckpt.fileStartSeq));
+    in.read((char *)&ckpt.fileBytes, sizeof(ckpt.fileBytes));
+    in.read((char *)&ckpt.flags, sizeof(ckpt.flags));
+    in.read((char *)&ckpt.blockOpen, sizeof(ckpt.blockOpen));
+    in.read((char *)&ckpt.blockStartSeq, sizeof(ckpt.blockStartSeq));
+    in.read((char *)&ckpt.state.expectedSeq, sizeof(ckpt.state.expectedSeq));
+    in.read((char *)&bitmapBytes, sizeof(bitmapBytes));
+    if (!in || bitmapBytes > CHECKPOINT_MAX_ENTRIES)
+        return false;
+    ckpt.state.bitmap.resize(bitmapBytes);
+    in.read((char *)ckpt.state.bitmap.data(), bitmapBytes);
+    in.read((char *)&markCount, sizeof(markCount));
+    if (!in || markCount > CHECKPOINT_MAX_ENTRIES)
+        return false;
+    ckpt.marks.resize(markCount);
+    in.read((char *)ckpt.marks.data(), markCount * sizeof(SegmentMark));
+    return (bool)in;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <netinet/in.h>
+
+// What a receiver does with a START or END
+enum ConnectionAction {
+    CONNECTION_IGNORE,    // from another connection: dropped without an ACK
+    CONNECTION_OPEN,      // START of a new connection
+    CONNECTION_TAKE_OVER, // START of a restarted sender resuming the active transfer
+    CONNECTION_REPEAT,    // a retransmission whose ACK was lost: ACK it again
+    CONNECTION_CLOSE      // END of the active connection
+};
+
+// The sender's address and port, as one value
+inline uint64_t peerKey(const sockaddr_in &addr) {
+    return (uint64_t)addr.sin_addr.s_addr << 16 | addr.sin_port;
+}
+
+// The receivers serve one connection at a time and ignore START from any other
+// while it is active. A connection is its sender (peerKey), START seqNum and
+// transfer id together: a restarted sender sends from a new port even if it
+// happens to pick the same seqNum. The decisions live here, apart from sockets
+// and files, so wtpSim runs the same START/END handling as wReceiver and
+// wReceiverOpt. The caller acts on a decision, then records it with
+// open/takeOver/close.
+class ReceiverConnection {
+public:
+    bool active = false;
+    uint32_t startSeq = 0;
+    uint32_t transferId = 0; // 0: the sender did not ask for resume
+    uint64_t peer = 0;
+
+    ConnectionAction onStart(uint32_t seqNum, uint32_t id, uint64_t from) const {
+        // Only a START of the same transfer is ever answered with its progress.
+        // That includes the connection just closed: a resumable sender whose END
+        // ACK was lost handshakes again, and must not start the transfer over.
+        if (seen && id == transferId && same(seqNum, from))
+            return CONNECTION_REPEAT;
+        if (!active)
+            return CONNECTION_OPEN;
+        return id != 0 && id == transferId ? CONNECTION_TAKE_OVER : CONNECTION_IGNORE;
+    }
+
+    ConnectionAction onEnd(uint32_t seqNum, uint64_t from) const {
+        if (active)
+            return same(seqNum, from) ? CONNECTION_CLOSE : CONNECTION_IGNORE;
+        // A retransmitted END for the connection just closed is ACKed again
+        return seen && same(seqNum, from) ? CONNECTION_REPEAT : CONNECTION_IGNORE;
+    }
+
+    void open(uint32_t seqNum, uint32_t id, uint64_t from) {
+        active = seen = true;
+        startSeq = seqNum;
+        transferId = id;
+        peer = from;
+    }
+
+    void takeOver(uint32_t seqNum, uint64_t from) {
+        startSeq = seqNum;
+        peer = from;
+    }
+
+    void close() { active = false; }
+
+    // After a local error: nothing more of the connection is ACKed, END included
+    void abandon() { active = seen = false; }
+
+private:
+    bool same(uint32_t seqNum, uint64_t from) const { return seqNum == startSeq && from == peer; }
+
+    bool seen = false;
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Expand the sender's inputs into the ordered list of files sent in one session.
+// Each input may be a regular file or a directory (its regular files are sent in
+// name order); listFile, if given, names one path per line. Returns false and
+// prints the offending path if anything cannot be read.
+inline bool collectInputFiles(const std::vector<std::string> &inputs, const std::string &listFile,
+                              std::vector<std::string> &files) {
+    std::vector<std::string> paths = inputs;
+    if (!listFile.empty()) {
+        std::ifstream list(listFile);
+        if (!list) {
+            std::cerr << "Error opening input list " << listFile << "\n";
+            return false;
+        }
+        std::string line;
+        while (std::getline(list, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (!line.empty())
+                paths.push_back(line);
+        }
+    }
+
+    for (const std::string &path : paths) {
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0) {
+            std::cerr << "Error opening input file " << path << "\n";
+            return false;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            files.push_back(path);
+            continue;
+        }
+        DIR *dir = opendir(path.c_str());
+        if (!dir) {
+            std::cerr << "Error opening input directory " << path << "\n";
+            return false;
+        }
+        std::vector<std::string> entries;
+        while (dirent *ent = readdir(dir)) {
+            std::string full = path + "/" + ent->d_name;
+            if (stat(full.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                entries.push_back(full);
+        }
+        closedir(dir);
+        std::sort(entries.begin(), entries.end());
+        files.insert(files.end(), entries.begin(), entries.end());
+    }
+    if (files.empty()) {
+        std::cerr << "No input files to send\n";
+        return false;
+    }
+    return true;
+}
+
+// Packets needed to send files uncompressed, dataSize bytes per DATA packet,
+// with an EOF between files. False if a file can no longer be read.
+inline bool countSessionPackets(const std::vector<std::string> &files, size_t dataSize, uint64_t &count) {
+    count = files.empty() ? 0 : files.size() - 1; // EOF boundaries
+    for (const std::string &path : files) {
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0) {
+            std::cerr << "Error opening input file " << path << "\n";
+            return false;
+        }
+        count += (st.st_size + dataSize - 1) / dataSize;
+    }
+    return true;
+}
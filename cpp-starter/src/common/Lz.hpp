@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// A small LZ77 block codec in the spirit of LZ4. A block is a run of sequences,
+// each a token byte (high nibble: literal count, low nibble: match length - 4,
+// 15 meaning "more length bytes follow"), the literals, then a 2-byte
+// little-endian match offset. The final sequence has literals only.
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_MAX_BLOCK_SIZE (1 << 16)
+
+inline uint32_t lzRead32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Variable-length tail of a literal or match length
+inline bool lzPutLength(char *&op, const char *opEnd, size_t len) {
+    while (len >= 255) {
+        if (op >= opEnd)
+            return false;
+        *op++ = (char)255;
+        len -= 255;
+    }
+    if (op >= opEnd)
+        return false;
+    *op++ = (char)len;
+    return true;
+}
+
+inline bool lzPutSequence(char *&op, const char *opEnd, const char *literals, size_t litLen,
+                          size_t offset, size_t matchLen) {
+    if (op >= opEnd)
+        return false;
+    char *token = op++;
+    size_t matchCode = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+    *token = (char)(((litLen < 15 ? litLen : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+    if (litLen >= 15 && !lzPutLength(op, opEnd, litLen - 15))
+        return false;
+    if ((size_t)(opEnd - op) < litLen)
+        return false;
+    if (litLen)
+        memcpy(op, literals, litLen);
+    op += litLen;
+    if (!matchLen)
+        return true;
+    if (opEnd - op < 2)
+        return false;
+    *op++ = (char)(offset & 0xFF);
+    *op++ = (char)(offset >> 8);
+    return matchCode < 15 || lzPutLength(op, opEnd, matchCode - 15);
+}
+
+// Compress src into dst. Returns the compressed size, or 0 if it does not fit
+// in dstCap, which callers treat as "incompressible".
+inline size_t lzCompress(const char *src, size_t srcLen, char *dst, size_t dstCap) {
+    std::vector<uint32_t> table(1 << LZ_HASH_BITS, 0); // position + 1 of the last 4-byte sequence seen
+    char *op = dst;
+    const char *opEnd = dst + dstCap;
+    size_t ip = 0, anchor = 0;
+    while (ip + LZ_MIN_MATCH <= srcLen) {
+        uint32_t seq = lzRead32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = ip + 1;
+        if (candidate && ip - (candidate - 1) <= LZ_MAX_OFFSET && lzRead32(src + candidate - 1) == seq) {
+            size_t ref = candidate - 1;
+            size_t len = LZ_MIN_MATCH;
+            while (ip + len < srcLen && src[ref + len] == src[ip + len])
+                len++;
+            if (!lzPutSequence(op, opEnd, src + anchor, ip - anchor, ip - ref, len))
+                return 0;
+            ip += len;
+            anchor = ip;
+        } else {
+            ip++;
+        }
+    }
+    if (!lzPutSequence(op, opEnd, src + anchor, srcLen - anchor, 0, 0))
+        return 0;
+    return op - dst;
+}
+
+// Decompress exactly dstLen bytes; false on any malformed input
+inline bool lzDecompress(const char *src, size_t srcLen, char *dst, size_t dstLen) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *ipEnd = ip + srcLen;
+    size_t out = 0;
+    while (ip < ipEnd) {
+        unsigned token = *ip++;
+        size_t litLen = token >> 4;
+        if (litLen == 15) {
+            unsigned char b;
+            do {
+                if (ip >= ipEnd)
+                    return false;
+                b = *ip++;
+                litLen += b;
+            } while (b == 255);
+        }
+        if ((size_t)(ipEnd - ip) < litLen || dstLen - out < litLen)
+            return false;
+        if (litLen)
+            memcpy(dst + out, ip, litLen);
+        ip += litLen;
+        out += litLen;
+        if (ip == ipEnd)
+            break; // final, literal-only sequence
+
+        if (ipEnd - ip < 2)
+            return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t matchLen = token & 0x0F;
+        if (matchLen == 15) {
+            unsigned char b;
+            do {
+                if (ip >= ipEnd)
+                    return false;
+                b = *ip++;
+                matchLen += b;
+            } while (b == 255);
+        }
+        matchLen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || dstLen - out < matchLen)
+            return false;
+        // Byte by byte, since a match may overlap the bytes it produces
+        for (size_t i = 0; i < matchLen; i++, out++)
+            dst[out] = dst[out - offset];
+    }
+    return out == dstLen;
+}
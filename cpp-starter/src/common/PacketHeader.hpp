@@ -3,8 +3,41 @@
 #include <cstdint>
 
 struct PacketHeader {
-    uint32_t type;     // 0: START; 1: END; 2: DATA; 3: ACK
+    uint32_t type;     // 0: START; 1: END; 2: DATA; 3: ACK; 4: EOF (file boundary in session mode); 5: ZDATA (compressed block fragment)
     uint32_t seqNum;   // Described below
     uint32_t length;   // Length of data; 0 for ACK packets
     uint32_t checksum; // 32-bit CRC
 };
+
+// RFC 1982 serial number arithmetic: a is before b if b is less than 2^31
+// ahead of it. seqNum wraps after 2^32 packets, so it is only ever compared
+// this way, never with plain < or >=.
+inline bool seqBefore(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+
+// A random START seqNum. END reuses it, and ACKs for both are plain ACKs that
+// echo it, so it is drawn outside [firstSeq, firstSeq + dataPackets], where
+// every DATA seqNum and every DATA ACK (a cumulative one runs one past the
+// last packet) lies: a late ACK for START never acknowledges DATA, and no
+// DATA ACK is taken for END's. A transfer of 2^32 - 1 packets or more uses
+// every seqNum, and any will do.
+template <class Random>
+inline uint32_t pickStartSeq(Random &random, uint32_t firstSeq, uint64_t dataPackets) {
+    uint32_t seqNum;
+    do
+        seqNum = random();
+    while (dataPackets < UINT32_MAX && (uint32_t)(seqNum - firstSeq) <= dataPackets);
+    return seqNum;
+}
+
+// Optional START payload (wSenderOpt): a uint32_t transfer id (0: not
+// resumable) followed by uint32_t option flags. A receiver that understands it
+// answers with a payload-carrying START ACK: the transfer id it is answering,
+// the flags it accepted, then its progress in that transfer (see
+// Checkpoint.hpp), which is empty unless the transfer id is nonzero.
+#define START_FLAG_COMPRESS 0x1 // file data may be sent as ZDATA blocks (see Lz.hpp)
+#define START_FLAG_SEQ64 0x2    // seqNum is the low half of a 64-bit packet number the receiver
+                                // reconstructs, so the transfer may run past 2^32 packets
+
+// A compressed block travels as consecutive ZDATA packets, all DATA-sized but
+// the last; the first begins with the uint32_t raw and compressed lengths
+#define ZDATA_BLOCK_HEADER_SIZE (2 * sizeof(uint32_t))
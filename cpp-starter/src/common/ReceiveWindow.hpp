@@ -0,0 +1,63 @@
+#pragma once
+
+#include "PacketHeader.hpp"
+#include <cstdint>
+#include <map>
+
+// The receiver's window, kept apart from sockets and storage so wtpSim can
+// drive the same logic as wReceiver/wReceiverOpt. Segment is whatever the
+// caller keeps per packet until it is delivered in order.
+//   selective (wReceiverOpt): packets in [expectedSeq, expectedSeq + windowSize)
+//                             are buffered, each is ACKed with its own seqNum,
+//                             and packets beyond the window are dropped unanswered
+//   cumulative (wReceiver):   only the next packet in order is taken, and every
+//                             packet is answered with the next seqNum expected
+// Positions are 64-bit packet numbers. The 32-bit seqNum on the wire is their
+// low half, placed relative to expectedSeq with serial number arithmetic.
+template <class Segment>
+class ReceiveWindow {
+public:
+    ReceiveWindow(uint32_t windowSize = 1, bool selective = true) : windowSize(windowSize), selective(selective) {}
+
+    uint64_t expectedSeq = 0;
+    std::map<uint64_t, Segment> pending; // received but not yet delivered, keyed by packet number
+
+    // False for a packet that is dropped without an ACK
+    bool answers(uint32_t seqNum) const { return !selective || ahead(seqNum) < (int64_t)windowSize; }
+
+    // The packet is new and within the window. The caller stores its payload
+    // at position(seqNum), then hands it to store(); a packet it failed to
+    // store is not ACKed.
+    bool wants(uint32_t seqNum) const {
+        int64_t offset = ahead(seqNum);
+        if (!selective)
+            return offset == 0 && pending.empty();
+        return offset >= 0 && offset < (int64_t)windowSize && !pending.count(expectedSeq + offset);
+    }
+
+    // The 64-bit packet number of a packet wants() accepted
+    uint64_t position(uint32_t seqNum) const { return expectedSeq + ahead(seqNum); }
+
+    void store(uint64_t seq, const Segment &seg) { pending[seq] = seg; }
+
+    // Take the next packet in order, if it has arrived
+    bool pop(uint64_t &seq, Segment &seg) {
+        typename std::map<uint64_t, Segment>::iterator it = pending.find(expectedSeq);
+        if (it == pending.end())
+            return false;
+        seq = expectedSeq++;
+        seg = it->second;
+        pending.erase(it);
+        return true;
+    }
+
+    // The ACK for a packet, once everything deliverable has been popped
+    uint32_t ackFor(uint32_t seqNum) const { return selective ? seqNum : (uint32_t)expectedSeq; }
+
+private:
+    // How far seqNum is past expectedSeq; negative for a packet already delivered
+    int64_t ahead(uint32_t seqNum) const { return (int32_t)(seqNum - (uint32_t)expectedSeq); }
+
+    uint32_t windowSize;
+    bool selective;
+};
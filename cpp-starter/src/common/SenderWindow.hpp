@@ -0,0 +1,169 @@
+#pragma once
+
+#include "PacketHeader.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+struct Packet {
+    PacketHeader header;
+    std::vector<char> data; // Only used for packets with a payload
+    std::chrono::steady_clock::time_point sendTime;
+    bool acked;
+};
+
+// The sender's sliding window. It never touches a socket or reads the clock:
+// callers pass in the time and a transmit callback, so wSender/wSenderOpt run
+// it on the real clock and wtpSim on a simulated one.
+//   cumulative (wSender):   an ACK for N acknowledges every packet before N, and
+//                           one timer per window resends everything in flight
+//   selective (wSenderOpt): an ACK acknowledges the packet with its seqNum, and
+//                           every packet has its own timer
+// In both, END waits until everything before it is ACKed and is ACKed with its
+// own seqNum. Packets leave as soon as they are ACKed, and every ACK or timer
+// costs O(log window) at most, so windows of hundreds of thousands of packets
+// stay cheap.
+class SenderWindow {
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    SenderWindow(size_t windowSize, bool selective, std::chrono::milliseconds timeout)
+        : windowSize(windowSize), selective(selective), timeout(timeout) {}
+
+    std::deque<Packet> packets; // queued in seqNum order, oldest not yet ACKed first
+    size_t next = 0;            // packets[0, next) have been sent
+    uint64_t transmissions = 0, retransmissions = 0;
+
+    // The caller may queue another packet
+    bool hasRoom() const { return packets.size() < windowSize; }
+    // Every queued packet has been ACKed
+    bool drained() const { return packets.empty(); }
+    // Nothing is in flight
+    bool idle() const { return next == 0; }
+
+    // Send the queued packets that fit in the window
+    template <class Transmit>
+    void sendNew(TimePoint now, Transmit transmit) {
+        if (next == 0)
+            timerStart = now;
+        while (next < packets.size() && next < windowSize) {
+            if (packets[next].header.type == 1 && next != 0)
+                break;
+            send(next++, now, transmit);
+            transmissions++;
+        }
+    }
+
+    // Mark what an ACK acknowledges and slide the window; true if it moved
+    bool onAck(uint32_t seqNum, TimePoint now) {
+        if (next == 0)
+            return false;
+        if (packets[0].header.type == 1) {
+            // END is only ever in flight alone
+            if (packets[0].header.seqNum == seqNum)
+                packets[0].acked = true;
+        } else if (selective) {
+            // In-flight packets are in serial order, so the one ACKed is found by bisection
+            std::deque<Packet>::iterator it = std::lower_bound(packets.begin(), packets.begin() + next, seqNum,
+                [](const Packet &pkt, uint32_t seq) { return seqBefore(pkt.header.seqNum, seq); });
+            if (it != packets.begin() + next && it->header.seqNum == seqNum)
+                it->acked = true;
+        } else if (!seqBefore(packets[next - 1].header.seqNum + 1, seqNum)) {
+            // Cumulative; an ACK beyond anything sent, such as a late ACK for START
+            // (see pickStartSeq), acknowledges nothing
+            for (size_t i = 0; i < next && seqBefore(packets[i].header.seqNum, seqNum); i++)
+                packets[i].acked = true;
+        }
+        if (!packets[0].acked)
+            return false;
+        while (next > 0 && packets[0].acked) {
+            packets.pop_front();
+            next--;
+            popped++;
+        }
+        timerStart = now;
+        return true;
+    }
+
+    // Resend whatever has timed out
+    template <class Transmit>
+    void onTimer(TimePoint now, Transmit transmit) {
+        if (selective) {
+            // Every packet has the same timeout, so timers expire in the order they were set
+            while (!timers.empty() && now - timers.front().sendTime >= timeout) {
+                Timer timer = timers.front();
+                timers.pop_front();
+                if (current(timer)) {
+                    send(timer.index - popped, now, transmit);
+                    retransmissions++;
+                }
+            }
+            return;
+        }
+        if (next == 0 || now - timerStart < timeout)
+            return;
+        for (size_t i = 0; i < next; i++) {
+            if (!packets[i].acked) {
+                send(i, now, transmit);
+                retransmissions++;
+            }
+        }
+        timerStart = now;
+    }
+
+    // When onTimer next has work to do; TimePoint::max() if nothing is in flight
+    TimePoint deadline() {
+        if (next == 0)
+            return TimePoint::max();
+        if (!selective)
+            return timerStart + timeout;
+        while (!timers.empty() && !current(timers.front()))
+            timers.pop_front();
+        return timers.empty() ? TimePoint::max() : timers.front().sendTime + timeout;
+    }
+
+    // How long to wait for ACKs before calling onTimer, at most one timeout
+    long waitMicros(TimePoint now) {
+        TimePoint due = deadline();
+        if (due <= now)
+            return 0;
+        if (due == TimePoint::max() || due - now > timeout)
+            return std::chrono::duration_cast<std::chrono::microseconds>(timeout).count();
+        return std::chrono::duration_cast<std::chrono::microseconds>(due - now).count();
+    }
+
+private:
+    // A (re)transmission; index counts every packet ever queued, so it survives the window sliding
+    struct Timer {
+        uint64_t index;
+        TimePoint sendTime;
+    };
+
+    // The packet is still unACKed and was not resent after this timer was set
+    bool current(const Timer &timer) const {
+        if (timer.index < popped)
+            return false;
+        const Packet &pkt = packets[timer.index - popped];
+        return !pkt.acked && pkt.sendTime == timer.sendTime;
+    }
+
+    template <class Transmit>
+    void send(size_t i, TimePoint now, Transmit &transmit) {
+        transmit(packets[i]);
+        packets[i].sendTime = now;
+        if (selective) {
+            Timer timer = {popped + i, now};
+            timers.push_back(timer);
+        }
+    }
+
+    size_t windowSize;
+    bool selective;
+    std::chrono::milliseconds timeout;
+    TimePoint timerStart;
+    std::deque<Timer> timers; // selective mode only, oldest first
+    uint64_t popped = 0;      // packets ACKed and removed from the front so far
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <chrono>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Runtime socket tuning shared by the senders and receivers:
+//   -b <bytes>  SO_RCVBUF/SO_SNDBUF size, applied as given even below the system
+//               default (default: derived from the window size, and only ever grown)
+//   -y <usec>   SO_BUSY_POLL budget
+//   -s          busy-spin on the socket instead of sleeping in select/recvfrom
+//   -c <cpu>    pin the I/O thread to one CPU
+struct SocketOptions {
+    int bufferBytes = 0;
+    int busyPollUs = 0;
+    bool spin = false;
+    int cpu = -1;
+};
+
+#define SOCKET_OPTION_FLAGS "b:y:sc:"
+#define SOCKET_MAX_DATAGRAM 1472 // MAX_PACKET_SIZE, the largest datagram either side sends
+#define SOCKET_OPTION_USAGE "[-b <socket-buffer-bytes>] [-y <busy-poll-usec>] [-s] [-c <cpu>]"
+
+// Handle one getopt result if it is a socket option; false otherwise
+inline bool parseSocketOption(int opt, const char *arg, SocketOptions &options) {
+    switch (opt) {
+        case 'b': options.bufferBytes = atoi(arg); return true;
+        case 'y': options.busyPollUs = atoi(arg); return true;
+        case 's': options.spin = true; return true;
+        case 'c': options.cpu = atoi(arg); return true;
+        default: return false;
+    }
+}
+
+// Size one of the socket's buffers for bytes of payload. The kernel doubles
+// the value it is given, to allow for its per-packet overhead, and getsockopt
+// reports the doubled value. SO_*BUFFORCE gets past net.core.[rw]mem_max when
+// we have CAP_NET_ADMIN. Unless exact, a buffer already large enough is left
+// alone; with exact the result is logged.
+inline void setSocketBuffer(int sock, int option, int forceOption, const char *name, int bytes, bool exact) {
+    int current = 0;
+    socklen_t len = sizeof(current);
+    getsockopt(sock, SOL_SOCKET, option, &current, &len);
+    if (!exact && current / 2 >= bytes)
+        return;
+    if (setsockopt(sock, SOL_SOCKET, forceOption, &bytes, sizeof(bytes)) < 0)
+        setsockopt(sock, SOL_SOCKET, option, &bytes, sizeof(bytes));
+    len = sizeof(current);
+    getsockopt(sock, SOL_SOCKET, option, &current, &len);
+    if (current / 2 < bytes)
+        std::cerr << name << " capped at " << current / 2 << " bytes (wanted " << bytes << "); raise net.core."
+                  << (option == SO_RCVBUF ? "rmem_max" : "wmem_max") << "\n";
+    else if (exact)
+        std::cerr << name << " set to " << current / 2 << " bytes (" << current << " with kernel overhead)\n";
+}
+
+// Apply buffer sizes and busy polling to sock, and turn on SO_RXQ_OVFL so
+// recvPacket can report datagrams the kernel dropped on a full receive queue.
+// Without -b both buffers hold a full window of the largest datagrams: the
+// receiver must queue a window of DATA, or the kernel drops what the sender
+// then waits 500 ms to resend, and the sender a window of ACKs. The kernel's
+// doubling (see setSocketBuffer) covers its own per-packet overhead.
+inline void applySocketOptions(int sock, const SocketOptions &options, int windowSize) {
+    bool exact = options.bufferBytes > 0;
+    long long windowBytes = (long long)windowSize * SOCKET_MAX_DATAGRAM;
+    int bytes = exact ? options.bufferBytes : (int)std::min(windowBytes, (long long)INT_MAX / 2);
+    setSocketBuffer(sock, SO_RCVBUF, SO_RCVBUFFORCE, "SO_RCVBUF", bytes, exact);
+    setSocketBuffer(sock, SO_SNDBUF, SO_SNDBUFFORCE, "SO_SNDBUF", bytes, exact);
+    if (options.busyPollUs > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &options.busyPollUs, sizeof(options.busyPollUs)) < 0)
+        perror("SO_BUSY_POLL");
+    int on = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+        perror("SO_RXQ_OVFL");
+}
+
+// Pin the calling thread to options.cpu, if set. The previous affinity is
+// saved in previous so threads started later can be moved back off that CPU.
+inline bool pinIoThread(const SocketOptions &options, cpu_set_t *previous) {
+    if (options.cpu < 0)
+        return false;
+    pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), previous);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(options.cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (err) {
+        std::cerr << "Could not pin to CPU " << options.cpu << ": " << strerror(err) << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Wait until sock is readable or timeoutUs passes (negative: forever). With
+// spin the thread polls without sleeping, trading a core for wakeup latency.
+inline bool waitReadable(int sock, long timeoutUs, bool spin) {
+    pollfd pfd = {sock, POLLIN, 0};
+    if (!spin)
+        return poll(&pfd, 1, timeoutUs < 0 ? -1 : (int)((timeoutUs + 999) / 1000)) > 0;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+    while (true) {
+        if (poll(&pfd, 1, 0) > 0)
+            return true;
+        if (timeoutUs >= 0 && std::chrono::steady_clock::now() >= deadline)
+            return false;
+    }
+}
+
+// recvfrom that also tracks SO_RXQ_OVFL: drops is updated to the socket's
+// running count of datagrams dropped because its receive queue was full
+inline ssize_t recvPacket(int sock, char *buf, size_t len, sockaddr_in *from, socklen_t *fromLen, uint32_t &drops) {
+    iovec iov = {buf, len};
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = from;
+    msg.msg_namelen = *fromLen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t recvd = recvmsg(sock, &msg, 0);
+    if (recvd < 0)
+        return recvd;
+    *fromLen = msg.msg_namelen;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+    }
+    return recvd;
+}
@@ -1,5 +1,8 @@
+#include "common/Connection.hpp"
 #include "common/Crc32.hpp"
 #include "common/PacketHeader.hpp"
+#include "common/ReceiveWindow.hpp"
+#include "common/SocketOptions.hpp"
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -18,25 +21,51 @@ using namespace std;
 #define MAX_PACKET_SIZE 1472
 #define HEADER_SIZE sizeof(PacketHeader)
 
+// A DATA or EOF packet waiting to be delivered in order
+struct Segment {
+    uint32_t type;
+    vector<char> data;
+};
+
 void logPacket(ofstream &logfile, const PacketHeader &header) {
     logfile << header.type << " " << header.seqNum << " " << header.length << " " << header.checksum << "\n";
     logfile.flush();
 }
 
+void sendAck(int sock, uint32_t seqNum, const sockaddr_in &toAddr, socklen_t toLen, ofstream &logfile) {
+    PacketHeader ack;
+    ack.type = 3;
+    ack.seqNum = seqNum;
+    ack.length = 0;
+    ack.checksum = crc32(&ack, HEADER_SIZE - sizeof(uint32_t));
+    sendto(sock, &ack, HEADER_SIZE, 0, (const sockaddr*)&toAddr, toLen);
+    logPacket(logfile, ack);
+}
+
+void writeOutputFile(const string &outputDir, int fileCount, const vector<char> &fileBuffer) {
+    string outFilename = outputDir + "/FILE-" + to_string(fileCount) + ".out";
+    ofstream outfile(outFilename, ios::binary);
+    outfile.write(fileBuffer.data(), fileBuffer.size());
+    outfile.close();
+}
+
 int main(int argc, char* argv[]) {
     int port = 0, windowSize = 0;
     string outputDir, logFile;
+    SocketOptions sockOpts;
     
     // Parse command-line arguments
     int opt;
-    while ((opt = getopt(argc, argv, "p:w:d:o:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:w:d:o:" SOCKET_OPTION_FLAGS)) != -1) {
         switch(opt) {
             case 'p': port = atoi(optarg); break;
             case 'w': windowSize = atoi(optarg); break;
             case 'd': outputDir = optarg; break;
             case 'o': logFile = optarg; break;
             default:
-                cerr << "Usage: ./wReceiver -p <port> -w <window-size> -d <output-dir> -o <output-log>\n";
+                if (parseSocketOption(opt, optarg, sockOpts))
+                    break;
+                cerr << "Usage: ./wReceiver -p <port> -w <window-size> -d <output-dir> -o <output-log> " SOCKET_OPTION_USAGE "\n";
                 return 1;
         }
     }
@@ -56,6 +85,10 @@ int main(int argc, char* argv[]) {
         perror("bind");
         return 1;
     }
+    applySocketOptions(sock, sockOpts, windowSize);
+    cpu_set_t otherCpus;
+    pinIoThread(sockOpts, &otherCpus);
+    uint32_t drops = 0, connectionDrops = 0;
     
     // Open log file for writing
     ofstream logfile(logFile);
@@ -64,80 +97,81 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
-    uint32_t expectedSeq = 0;
+    ReceiverConnection connection;
+    ReceiveWindow<Segment> window;
     vector<char> fileBuffer;
-    bool connectionActive = false;
     int fileCount = 0;
     
     while (true) {
         char buffer[MAX_PACKET_SIZE];
         sockaddr_in fromAddr;
         socklen_t fromLen = sizeof(fromAddr);
-        ssize_t recvd = recvfrom(sock, buffer, MAX_PACKET_SIZE, 0, (sockaddr*)&fromAddr, &fromLen);
+        if (sockOpts.spin)
+            waitReadable(sock, -1, true);
+        ssize_t recvd = recvPacket(sock, buffer, MAX_PACKET_SIZE, &fromAddr, &fromLen, drops);
         if (recvd < (ssize_t)HEADER_SIZE)
             continue;
         PacketHeader header;
         memcpy(&header, buffer, HEADER_SIZE);
         logPacket(logfile, header);
         
-        // Recompute checksum and drop packet if it does not match
-        uint32_t calcChecksum = 0;
-        if (header.type == 2) {
-            PacketHeader temp = header;
-            temp.checksum = 0;
-            calcChecksum = crc32(&temp, HEADER_SIZE) ^ crc32(buffer + HEADER_SIZE, header.length);
-        } else {
-            PacketHeader temp = header;
-            temp.checksum = 0;
-            calcChecksum = crc32(&temp, HEADER_SIZE);
-        }
+        // Recompute checksum over the header and any payload; drop packet if it does not match
+        if (header.length > (size_t)recvd - HEADER_SIZE)
+            continue; // truncated datagram
+        PacketHeader temp = header;
+        temp.checksum = 0;
+        uint32_t calcChecksum = crc32(&temp, HEADER_SIZE) ^ crc32(buffer + HEADER_SIZE, header.length);
         if (calcChecksum != header.checksum)
             continue; // drop packet
         
         // Process packet types
         if (header.type == 0) { // START packet
-            if (connectionActive)
-                continue; // ignore new START if already in a connection
-            connectionActive = true;
-            expectedSeq = 0;
-            fileBuffer.clear();
+            // A repeated START means our ACK was lost; START from any other connection is ignored
+            ConnectionAction action = connection.onStart(header.seqNum, 0, peerKey(fromAddr));
+            if (action == CONNECTION_IGNORE)
+                continue;
+            if (action == CONNECTION_OPEN) {
+                connection.open(header.seqNum, 0, peerKey(fromAddr));
+                connectionDrops = drops;
+                window = ReceiveWindow<Segment>(windowSize, false);
+                fileBuffer.clear();
+            }
             // Send ACK for START (ACK seq = start packet’s seqNum)
-            PacketHeader ack;
-            ack.type = 3;
-            ack.seqNum = header.seqNum;
-            ack.length = 0;
-            ack.checksum = crc32(&ack, HEADER_SIZE - sizeof(uint32_t));
-            sendto(sock, &ack, HEADER_SIZE, 0, (sockaddr*)&fromAddr, fromLen);
-            logPacket(logfile, ack);
-        } else if (header.type == 2 && connectionActive) { // DATA packet
-            if (header.seqNum == expectedSeq) {
-                // Accept in-order packet and append its data
-                fileBuffer.insert(fileBuffer.end(), buffer + HEADER_SIZE, buffer + HEADER_SIZE + header.length);
-                expectedSeq++;
+            sendAck(sock, header.seqNum, fromAddr, fromLen, logfile);
+        } else if ((header.type == 2 || header.type == 4) && connection.active) { // DATA or EOF packet
+            // Only the in-order packet is accepted (see ReceiveWindow.hpp)
+            if (window.wants(header.seqNum)) {
+                Segment seg = {header.type, vector<char>(buffer + HEADER_SIZE, buffer + HEADER_SIZE + header.length)};
+                window.store(window.position(header.seqNum), seg);
+            }
+            uint64_t seq;
+            Segment seg;
+            while (window.pop(seq, seg)) {
+                if (seg.type == 2) {
+                    fileBuffer.insert(fileBuffer.end(), seg.data.begin(), seg.data.end());
+                } else {
+                    // File boundary within a session: the next DATA packet starts a new file
+                    writeOutputFile(outputDir, fileCount++, fileBuffer);
+                    fileBuffer.clear();
+                }
             }
             // Send cumulative ACK (next expected seq)
-            PacketHeader ack;
-            ack.type = 3;
-            ack.seqNum = expectedSeq;
-            ack.length = 0;
-            ack.checksum = crc32(&ack, HEADER_SIZE - sizeof(uint32_t));
-            sendto(sock, &ack, HEADER_SIZE, 0, (sockaddr*)&fromAddr, fromLen);
-            logPacket(logfile, ack);
-        } else if (header.type == 1 && connectionActive) { // END packet
-            // Send ACK for END packet (ACK seq = same as END packet’s seqNum)
-            PacketHeader ack;
-            ack.type = 3;
-            ack.seqNum = header.seqNum;
-            ack.length = 0;
-            ack.checksum = crc32(&ack, HEADER_SIZE - sizeof(uint32_t));
-            sendto(sock, &ack, HEADER_SIZE, 0, (sockaddr*)&fromAddr, fromLen);
-            logPacket(logfile, ack);
-            // Write the received file to disk
-            string outFilename = outputDir + "/FILE-" + to_string(fileCount++) + ".out";
-            ofstream outfile(outFilename, ios::binary);
-            outfile.write(fileBuffer.data(), fileBuffer.size());
-            outfile.close();
-            connectionActive = false;
+            sendAck(sock, window.ackFor(header.seqNum), fromAddr, fromLen, logfile);
+        } else if (header.type == 1) { // END packet
+            ConnectionAction action = connection.onEnd(header.seqNum, peerKey(fromAddr));
+            if (action == CONNECTION_IGNORE)
+                continue;
+            if (action == CONNECTION_CLOSE) {
+                // Write the received file to disk
+                writeOutputFile(outputDir, fileCount++, fileBuffer);
+                fileBuffer.clear();
+                connection.close();
+                cerr << "Connection ending with FILE-" << fileCount - 1 << ".out: kernel dropped "
+                     << drops - connectionDrops << " datagrams (SO_RXQ_OVFL)\n";
+            }
+            // Send ACK for END packet (ACK seq = same as END packet’s seqNum); a
+            // retransmitted END for the connection just closed is ACKed again
+            sendAck(sock, header.seqNum, fromAddr, fromLen, logfile);
         }
     }
     
@@ -1,5 +1,10 @@
+#include "common/Checkpoint.hpp"
+#include "common/Connection.hpp"
 #include "common/Crc32.hpp"
+#include "common/Lz.hpp"
 #include "common/PacketHeader.hpp"
+#include "common/ReceiveWindow.hpp"
+#include "common/SocketOptions.hpp"
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -12,30 +17,305 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <map>
+#include <algorithm>
+#include <cerrno>
 
 using namespace std;
 
 #define MAX_PACKET_SIZE 1472
 #define HEADER_SIZE sizeof(PacketHeader)
+#define DATA_SIZE (MAX_PACKET_SIZE - HEADER_SIZE)
+#define CHECKPOINT_INTERVAL 256 // accepted packets between checkpoint writes
+
+// A DATA, ZDATA or EOF packet waiting to be delivered in order; its payload is already on disk
+struct Segment {
+    uint32_t type;
+    uint32_t length;
+};
+
+// The connection being received. Payloads are written straight into a part
+// file at offset (64-bit packet number) * DATA_SIZE, so packets that arrive out of order survive
+// a restart; each file is copied out once its EOF (or END) is delivered. In a
+// compressed transfer the file is instead written as packets are delivered in
+// order, one decompressed block at a time.
+struct Transfer {
+    uint32_t transferId = 0; // 0: the sender did not ask for resume
+    uint32_t flags = 0;      // START option flags
+    ReceiveWindow<Segment> window;
+    uint32_t fileCount = 0;
+    uint64_t fileStartSeq = 0;
+    uint64_t fileBytes = 0;
+    bool blockOpen = false; // a compressed block is partly delivered...
+    uint64_t blockStartSeq = 0; // ...starting at this packet number
+    uint32_t sinceCheckpoint = 0;
+    int partFd = -1;
+    int outFd = -1; // FILE-i.out of a compressed transfer, while it is being written
+    string partPath, ckptPath;
+};
 
 void logPacket(ofstream &logfile, const PacketHeader &header) {
     logfile << header.type << " " << header.seqNum << " " << header.length << " " << header.checksum << "\n";
     logfile.flush();
 }
 
+void sendAck(int sock, uint32_t seqNum, const sockaddr_in &toAddr, socklen_t toLen, ofstream &logfile) {
+    PacketHeader ack;
+    ack.type = 3;
+    ack.seqNum = seqNum;
+    ack.length = 0;
+    ack.checksum = crc32(&ack, HEADER_SIZE - sizeof(uint32_t));
+    sendto(sock, &ack, HEADER_SIZE, 0, (const sockaddr*)&toAddr, toLen);
+    logPacket(logfile, ack);
+}
+
+ResumeState resumeState(const Transfer &t) {
+    ResumeState state;
+    state.expectedSeq = t.window.expectedSeq;
+    for (map<uint64_t, Segment>::const_iterator it = t.window.pending.begin(); it != t.window.pending.end(); ++it)
+        state.mark(it->first);
+    return state;
+}
+
+// The ACK for a START with options confirms the flags we accepted and, for a
+// resumable transfer, tells the sender which packets it can skip
+void sendStartAck(int sock, uint32_t seqNum, const Transfer &t, const sockaddr_in &toAddr, socklen_t toLen, ofstream &logfile) {
+    char buffer[MAX_PACKET_SIZE];
+    uint32_t prefix[2] = {t.transferId, t.flags};
+    vector<char> payload;
+    encodeResumeState(t.transferId ? resumeState(t) : ResumeState(), payload, MAX_PACKET_SIZE - HEADER_SIZE - sizeof(prefix));
+    payload.insert(payload.begin(), (const char*)prefix, (const char*)prefix + sizeof(prefix));
+    PacketHeader ack;
+    ack.type = 3;
+    ack.seqNum = seqNum;
+    ack.length = payload.size();
+    ack.checksum = 0;
+    ack.checksum = crc32(&ack, HEADER_SIZE) ^ crc32(payload.data(), payload.size());
+    memcpy(buffer, &ack, HEADER_SIZE);
+    memcpy(buffer + HEADER_SIZE, payload.data(), payload.size());
+    sendto(sock, buffer, HEADER_SIZE + payload.size(), 0, (const sockaddr*)&toAddr, toLen);
+    logPacket(logfile, ack);
+}
+
+void saveTransfer(Transfer &t) {
+    t.sinceCheckpoint = 0;
+    if (!t.transferId)
+        return;
+    Checkpoint ckpt;
+    ckpt.transferId = t.transferId;
+    ckpt.fileCount = t.fileCount;
+    ckpt.fileStartSeq = t.fileStartSeq;
+    ckpt.fileBytes = t.fileBytes;
+    ckpt.flags = t.flags;
+    ckpt.blockOpen = t.blockOpen;
+    ckpt.blockStartSeq = t.blockStartSeq;
+    ckpt.state = resumeState(t);
+    for (map<uint64_t, Segment>::const_iterator it = t.window.pending.begin(); it != t.window.pending.end(); ++it) {
+        if (it->second.type != 2 || it->second.length != DATA_SIZE) {
+            SegmentMark mark = {it->first, it->second.type, it->second.length};
+            ckpt.marks.push_back(mark);
+        }
+    }
+    if (!saveCheckpoint(t.ckptPath, ckpt))
+        cerr << "Error writing checkpoint " << t.ckptPath << "\n";
+}
+
+// Start receiving a connection, picking up from the checkpoint left by an
+// earlier run if the sender asked to resume the same transfer
+bool openTransfer(Transfer &t, const string &outputDir, uint32_t windowSize, uint32_t transferId, uint32_t flags, uint32_t fileCount) {
+    t = Transfer();
+    t.window = ReceiveWindow<Segment>(windowSize, true);
+    t.transferId = transferId;
+    t.flags = flags;
+    t.fileCount = fileCount;
+    string stem = outputDir + "/.wtp-" + (transferId ? to_string(transferId) : string("stream"));
+    t.partPath = stem + ".part";
+    t.ckptPath = stem + ".ckpt";
+
+    Checkpoint ckpt;
+    bool resumed = transferId && loadCheckpoint(t.ckptPath, ckpt) && ckpt.transferId == transferId && ckpt.flags == flags;
+    t.partFd = open(t.partPath.c_str(), O_RDWR | O_CREAT | (resumed ? 0 : O_TRUNC), 0644);
+    if (t.partFd < 0) {
+        perror("open");
+        return false;
+    }
+    if (resumed) {
+        t.fileCount = ckpt.fileCount;
+        t.fileStartSeq = ckpt.fileStartSeq;
+        t.fileBytes = ckpt.fileBytes;
+        t.blockOpen = ckpt.blockOpen;
+        t.blockStartSeq = ckpt.blockStartSeq;
+        t.window.expectedSeq = ckpt.state.expectedSeq;
+        for (uint64_t bit = 0; bit < ckpt.state.bitmap.size() * 8; bit++) {
+            if (ckpt.state.received(t.window.expectedSeq + bit)) {
+                Segment seg = {2, DATA_SIZE};
+                t.window.store(t.window.expectedSeq + bit, seg);
+            }
+        }
+        for (size_t i = 0; i < ckpt.marks.size(); i++) {
+            Segment seg = {ckpt.marks[i].type, ckpt.marks[i].length};
+            t.window.store(ckpt.marks[i].seqNum, seg);
+        }
+    }
+    return true;
+}
+
+// Open FILE-i.out of a compressed transfer, cut back to what the (possibly
+// restored) transfer state says has been written
+bool ensureOutput(Transfer &t, const string &outputDir) {
+    if (t.outFd >= 0)
+        return true;
+    string outFilename = outputDir + "/FILE-" + to_string(t.fileCount) + ".out";
+    t.outFd = open(outFilename.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (t.outFd < 0 || ftruncate(t.outFd, t.fileBytes) < 0) {
+        perror("open");
+        return false;
+    }
+    return true;
+}
+
+// Deliver one in-order packet of a compressed transfer: raw DATA is appended
+// as is, and a ZDATA block is decompressed once its last fragment arrives.
+// False if the packet could not be read back or its output written.
+bool deliverCompressed(Transfer &t, const string &outputDir, uint64_t seq, const Segment &seg) {
+    if (!ensureOutput(t, outputDir))
+        return false;
+    vector<char> in;
+    off_t start = (off_t)seq * DATA_SIZE;
+    if (seg.type == 2) {
+        in.resize(seg.length);
+        if (pread(t.partFd, in.data(), in.size(), start) != (ssize_t)in.size() ||
+            pwrite(t.outFd, in.data(), in.size(), t.fileBytes) != (ssize_t)in.size()) {
+            cerr << "Error writing FILE-" << t.fileCount << ".out\n";
+            return false;
+        }
+        t.fileBytes += in.size();
+        return true;
+    }
+
+    if (!t.blockOpen) {
+        t.blockOpen = true;
+        t.blockStartSeq = seq;
+    }
+    // Fragments sit back to back in the part file, so the block is one read
+    uint32_t lengths[2]; // raw, compressed
+    start = (off_t)t.blockStartSeq * DATA_SIZE;
+    uint64_t have = (seq - t.blockStartSeq) * DATA_SIZE + seg.length;
+    if (have < ZDATA_BLOCK_HEADER_SIZE)
+        return true;
+    if (pread(t.partFd, lengths, sizeof(lengths), start) != (ssize_t)sizeof(lengths)) {
+        cerr << "Error reading " << t.partPath << "\n";
+        return false;
+    }
+    if (have < ZDATA_BLOCK_HEADER_SIZE + lengths[1])
+        return true;
+    t.blockOpen = false;
+    if (lengths[0] > LZ_MAX_BLOCK_SIZE || lengths[1] > LZ_MAX_BLOCK_SIZE) {
+        cerr << "Malformed compressed block at packet " << t.blockStartSeq << "\n";
+        return false;
+    }
+    vector<char> out(lengths[0]);
+    in.resize(lengths[1]);
+    if (pread(t.partFd, in.data(), in.size(), start + ZDATA_BLOCK_HEADER_SIZE) != (ssize_t)in.size() ||
+        !lzDecompress(in.data(), in.size(), out.data(), out.size())) {
+        cerr << "Malformed compressed block at packet " << t.blockStartSeq << "\n";
+        return false;
+    }
+    if (pwrite(t.outFd, out.data(), out.size(), t.fileBytes) != (ssize_t)out.size()) {
+        cerr << "Error writing FILE-" << t.fileCount << ".out\n";
+        return false;
+    }
+    t.fileBytes += out.size();
+    return true;
+}
+
+// Copy the file currently being received out of the part file into FILE-i.out
+bool extractFile(Transfer &t, const string &outputDir, bool final) {
+    if (t.flags & START_FLAG_COMPRESS) {
+        // Already written during delivery
+        if (!ensureOutput(t, outputDir))
+            return false;
+        close(t.outFd);
+        t.outFd = -1;
+        return true;
+    }
+    string outFilename = outputDir + "/FILE-" + to_string(t.fileCount) + ".out";
+    if (final && t.fileStartSeq == 0) {
+        // A single-file connection: the part file already is the output
+        if (ftruncate(t.partFd, t.fileBytes) == 0 && rename(t.partPath.c_str(), outFilename.c_str()) == 0)
+            return true;
+    }
+    ofstream outfile(outFilename, ios::binary);
+    vector<char> chunk(1 << 16);
+    off_t start = (off_t)t.fileStartSeq * DATA_SIZE;
+    uint64_t copied = 0;
+    while (copied < t.fileBytes) {
+        size_t want = min((uint64_t)chunk.size(), t.fileBytes - copied);
+        ssize_t got = pread(t.partFd, chunk.data(), want, start + copied);
+        if (got <= 0)
+            return false;
+        outfile.write(chunk.data(), got);
+        copied += got;
+    }
+    outfile.close();
+    return (bool)outfile;
+}
+
+// Free the part file's space for a file already copied out; a filesystem that
+// cannot punch holes just keeps it
+bool releaseSpace(int fd, off_t start, off_t length) {
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, length) == 0 || errno == EOPNOTSUPP || errno == ENOSYS)
+        return true;
+    perror("fallocate");
+    return false;
+}
+
+// Stop receiving after a local error. The part file and checkpoint stay, so a
+// resumable sender that handshakes again continues from the last checkpoint.
+void abandonTransfer(Transfer &t) {
+    if (t.outFd >= 0)
+        close(t.outFd);
+    t.outFd = -1;
+    close(t.partFd);
+    t.partFd = -1;
+    if (!t.transferId)
+        unlink(t.partPath.c_str());
+}
+
+// After a local error: nothing more of the connection is ACKed. Later
+// connections number their files past the ones it wrote, so a resume finds
+// them intact.
+void failTransfer(Transfer &t, ReceiverConnection &connection, uint32_t &fileCount) {
+    abandonTransfer(t);
+    connection.abandon();
+    fileCount = max(fileCount, t.fileCount + 1);
+    cerr << "Transfer abandoned; a resumable sender continues from the last checkpoint\n";
+}
+
+void closeTransfer(Transfer &t) {
+    abandonTransfer(t);
+    unlink(t.partPath.c_str());
+    if (t.transferId)
+        unlink(t.ckptPath.c_str());
+}
+
 int main(int argc, char* argv[]) {
     int port = 0, windowSize = 0;
     string outputDir, logFile;
+    SocketOptions sockOpts;
     
     int opt;
-    while ((opt = getopt(argc, argv, "p:w:d:o:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:w:d:o:" SOCKET_OPTION_FLAGS)) != -1) {
         switch(opt) {
             case 'p': port = atoi(optarg); break;
             case 'w': windowSize = atoi(optarg); break;
             case 'd': outputDir = optarg; break;
             case 'o': logFile = optarg; break;
             default:
-                cerr << "Usage: ./wReceiverOpt -p <port> -w <window-size> -d <output-dir> -o <output-log>\n";
+                if (parseSocketOption(opt, optarg, sockOpts))
+                    break;
+                cerr << "Usage: ./wReceiverOpt -p <port> -w <window-size> -d <output-dir> -o <output-log> " SOCKET_OPTION_USAGE "\n";
                 return 1;
         }
     }
@@ -54,6 +334,10 @@ int main(int argc, char* argv[]) {
         perror("bind");
         return 1;
     }
+    applySocketOptions(sock, sockOpts, windowSize);
+    cpu_set_t otherCpus;
+    pinIoThread(sockOpts, &otherCpus);
+    uint32_t drops = 0, connectionDrops = 0;
     
     ofstream logfile(logFile);
     if (!logfile) {
@@ -61,80 +345,131 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
-    uint32_t expectedSeq = 0;
-    vector<char> fileBuffer;
-    bool connectionActive = false;
-    int fileCount = 0;
+    ReceiverConnection connection;
+    Transfer transfer;
+    uint32_t fileCount = 0;
     
     while (true) {
         char buffer[MAX_PACKET_SIZE];
         sockaddr_in fromAddr;
         socklen_t fromLen = sizeof(fromAddr);
-        ssize_t recvd = recvfrom(sock, buffer, MAX_PACKET_SIZE, 0, (sockaddr*)&fromAddr, &fromLen);
+        if (sockOpts.spin)
+            waitReadable(sock, -1, true);
+        ssize_t recvd = recvPacket(sock, buffer, MAX_PACKET_SIZE, &fromAddr, &fromLen, drops);
         if (recvd < (ssize_t)HEADER_SIZE)
             continue;
         PacketHeader header;
         memcpy(&header, buffer, HEADER_SIZE);
         logPacket(logfile, header);
         
-        uint32_t calcChecksum = 0;
-        if (header.type == 2) {
-            PacketHeader temp = header;
-            temp.checksum = 0;
-            calcChecksum = crc32(&temp, HEADER_SIZE) ^ crc32(buffer + HEADER_SIZE, header.length);
-        } else {
-            PacketHeader temp = header;
-            temp.checksum = 0;
-            calcChecksum = crc32(&temp, HEADER_SIZE);
-        }
+        // The checksum covers the header and any payload (DATA, or a resumable START)
+        if (header.length > (size_t)recvd - HEADER_SIZE)
+            continue; // truncated datagram
+        PacketHeader temp = header;
+        temp.checksum = 0;
+        uint32_t calcChecksum = crc32(&temp, HEADER_SIZE) ^ crc32(buffer + HEADER_SIZE, header.length);
         if (calcChecksum != header.checksum)
             continue;
         
         if (header.type == 0) { // START packet
-            if (connectionActive)
+            uint32_t transferId = 0, flags = 0;
+            if (header.length >= sizeof(uint32_t))
+                memcpy(&transferId, buffer + HEADER_SIZE, sizeof(uint32_t));
+            if (header.length >= 2 * sizeof(uint32_t))
+                memcpy(&flags, buffer + HEADER_SIZE + sizeof(uint32_t), sizeof(uint32_t));
+            // Options we do not know are left out of the ACK, so the sender does without them
+            flags &= START_FLAG_COMPRESS | START_FLAG_SEQ64;
+            // A restarted sender resuming the transfer in progress takes it over, and
+            // a repeated START, even of the connection just closed, gets its progress
+            // again; START from any other connection is ignored
+            ConnectionAction action = connection.onStart(header.seqNum, transferId, peerKey(fromAddr));
+            if (action == CONNECTION_IGNORE)
+                continue;
+            if (action == CONNECTION_TAKE_OVER) {
+                saveTransfer(transfer);
+                connection.takeOver(header.seqNum, peerKey(fromAddr));
+            } else if (action == CONNECTION_OPEN) {
+                if (!openTransfer(transfer, outputDir, windowSize, transferId, flags, fileCount))
+                    continue;
+                connection.open(header.seqNum, transferId, peerKey(fromAddr));
+                connectionDrops = drops;
+            }
+            // In optimized mode, send ACK with same seqNum as the START packet; a START
+            // with options gets our progress back, which also confirms we support them
+            if (header.length > 0)
+                sendStartAck(sock, header.seqNum, transfer, fromAddr, fromLen, logfile);
+            else
+                sendAck(sock, header.seqNum, fromAddr, fromLen, logfile);
+        } else if ((header.type == 2 || header.type == 4 || header.type == 5) && connection.active) { // DATA, EOF or ZDATA packet
+            // Only accept packets within our window (see ReceiveWindow.hpp)
+            if (!transfer.window.answers(header.seqNum))
+                continue;
+            if (transfer.window.wants(header.seqNum)) {
+                uint64_t seq = transfer.window.position(header.seqNum);
+                Segment seg = {header.type, header.type != 4 ? header.length : 0};
+                if (seg.length && pwrite(transfer.partFd, buffer + HEADER_SIZE, seg.length, (off_t)seq * DATA_SIZE) != (ssize_t)seg.length)
+                    continue; // not stored, so not ACKed
+                transfer.window.store(seq, seg);
+                transfer.sinceCheckpoint++;
+            }
+            // Deliver everything that is now in order
+            uint64_t seq;
+            Segment seg;
+            bool failed = false;
+            while (!failed && transfer.window.pop(seq, seg)) {
+                if (seg.type != 4 && (transfer.flags & START_FLAG_COMPRESS)) {
+                    if (!deliverCompressed(transfer, outputDir, seq, seg)) {
+                        failed = true;
+                        break;
+                    }
+                } else {
+                    transfer.fileBytes += seg.length;
+                }
+                if (seg.type == 4) {
+                    // File boundary within a session: the next DATA packet starts a new file.
+                    // The checkpoint must move past the file before its data is released.
+                    if (!extractFile(transfer, outputDir, false)) {
+                        cerr << "Error writing FILE-" << transfer.fileCount << ".out\n";
+                        failed = true;
+                        break;
+                    }
+                    off_t start = (off_t)transfer.fileStartSeq * DATA_SIZE;
+                    off_t length = (off_t)(seq - transfer.fileStartSeq) * DATA_SIZE;
+                    transfer.fileCount++;
+                    transfer.fileStartSeq = transfer.window.expectedSeq;
+                    transfer.fileBytes = 0;
+                    saveTransfer(transfer);
+                    if (length && !releaseSpace(transfer.partFd, start, length))
+                        failed = true;
+                }
+            }
+            if (failed) {
+                failTransfer(transfer, connection, fileCount);
+                continue;
+            }
+            if (transfer.sinceCheckpoint >= CHECKPOINT_INTERVAL)
+                saveTransfer(transfer);
+            // In optimized mode, send an ACK with the packet’s seqNum (duplicates included,
+            // in case the first ACK was lost)
+            sendAck(sock, transfer.window.ackFor(header.seqNum), fromAddr, fromLen, logfile);
+        } else if (header.type == 1) { // END packet
+            ConnectionAction action = connection.onEnd(header.seqNum, peerKey(fromAddr));
+            if (action == CONNECTION_IGNORE)
                 continue;
-            connectionActive = true;
-            expectedSeq = 0;
-            fileBuffer.clear();
-            // In optimized mode, send ACK with same seqNum as the START packet
-            PacketHeader ack;
-            ack.type = 3;
-            ack.seqNum = header.seqNum;
-            ack.length = 0;
-            ack.checksum = crc32(&ack, HEADER_SIZE - sizeof(uint32_t));
-            sendto(sock, &ack, HEADER_SIZE, 0, (sockaddr*)&fromAddr, fromLen);
-            logPacket(logfile, ack);
-        } else if (header.type == 2 && connectionActive) { // DATA packet
-            // Only accept packets within our window
-            if (header.seqNum >= expectedSeq && header.seqNum < expectedSeq + windowSize) {
-                // If the packet is the expected one, append data
-                if (header.seqNum == expectedSeq) {
-                    fileBuffer.insert(fileBuffer.end(), buffer + HEADER_SIZE, buffer + HEADER_SIZE + header.length);
-                    expectedSeq++;
+            if (action == CONNECTION_CLOSE) {
+                // Write the received data to a file; END is not ACKed if that fails
+                if (!extractFile(transfer, outputDir, true)) {
+                    cerr << "Error writing FILE-" << transfer.fileCount << ".out\n";
+                    failTransfer(transfer, connection, fileCount);
+                    continue;
                 }
-                // In optimized mode, send an ACK with the packet’s seqNum
-                PacketHeader ack;
-                ack.type = 3;
-                ack.seqNum = header.seqNum;
-                ack.length = 0;
-                ack.checksum = crc32(&ack, HEADER_SIZE - sizeof(uint32_t));
-                sendto(sock, &ack, HEADER_SIZE, 0, (sockaddr*)&fromAddr, fromLen);
-                logPacket(logfile, ack);
+                closeTransfer(transfer);
+                fileCount = transfer.fileCount + 1;
+                connection.close();
+                cerr << "Connection ending with FILE-" << transfer.fileCount << ".out: kernel dropped "
+                     << drops - connectionDrops << " datagrams (SO_RXQ_OVFL)\n";
             }
-        } else if (header.type == 1 && connectionActive) { // END packet
-            PacketHeader ack;
-            ack.type = 3;
-            ack.seqNum = header.seqNum;
-            ack.length = 0;
-            ack.checksum = crc32(&ack, HEADER_SIZE - sizeof(uint32_t));
-            sendto(sock, &ack, HEADER_SIZE, 0, (sockaddr*)&fromAddr, fromLen);
-            logPacket(logfile, ack);
-            // Write the received data to a file
-            string outFilename = outputDir + "/FILE-" + to_string(fileCount++) + ".out";
-            ofstream outfile(outFilename, ios::binary);
-            outfile.write(fileBuffer.data(), fileBuffer.size());
-            outfile.close();
-            connectionActive = false;
+            sendAck(sock, header.seqNum, fromAddr, fromLen, logfile);
         }
     }
     
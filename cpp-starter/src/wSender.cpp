@@ -1,8 +1,13 @@
 #include "common/Crc32.hpp"
+#include "common/InputFiles.hpp"
 #include "common/PacketHeader.hpp"
+#include "common/SenderWindow.hpp"
+#include "common/SocketOptions.hpp"
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <deque>
+#include <random>
 #include <chrono>
 #include <thread>
 #include <cstring>
@@ -21,47 +26,97 @@ using namespace std::chrono;
 #define DATA_SIZE (MAX_PACKET_SIZE - HEADER_SIZE)
 #define TIMEOUT_MS 500
 
-// Structure to hold packet info
-struct Packet {
-    PacketHeader header;
-    vector<char> data; // Only used for DATA packets
-    steady_clock::time_point sendTime;
-    bool acked;
-};
-
 void logPacket(ofstream &logfile, const PacketHeader &header) {
     logfile << header.type << " " << header.seqNum << " " << header.length << " " << header.checksum << "\n";
     logfile.flush();
 }
 
+// START, END and EOF packets carry no data; their checksum covers the header only
+Packet makeControlPacket(uint32_t type, uint32_t seqNum) {
+    Packet pkt;
+    pkt.header.type = type;
+    pkt.header.seqNum = seqNum;
+    pkt.header.length = 0;
+    pkt.header.checksum = 0;
+    pkt.header.checksum = crc32(&pkt.header, HEADER_SIZE);
+    pkt.acked = false;
+    return pkt;
+}
+
+// Header and data go out in a single datagram
+void sendPacket(int sock, const sockaddr_in &servAddr, Packet &pkt, ofstream &logfile) {
+    char buffer[MAX_PACKET_SIZE];
+    memcpy(buffer, &pkt.header, HEADER_SIZE);
+    if (!pkt.data.empty())
+        memcpy(buffer + HEADER_SIZE, pkt.data.data(), pkt.data.size());
+    sendto(sock, buffer, HEADER_SIZE + pkt.data.size(), 0, (const sockaddr*)&servAddr, sizeof(servAddr));
+    logPacket(logfile, pkt.header);
+}
+
+// Append the DATA packets for one file, followed by an EOF boundary unless it
+// is the last file of the session
+bool appendFilePackets(deque<Packet> &packets, const string &path, uint32_t &seq, bool last) {
+    ifstream infile(path, ios::binary);
+    if (!infile) {
+        cerr << "Error opening input file " << path << "\n";
+        return false;
+    }
+    vector<char> fileData((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+    infile.close();
+
+    size_t offset = 0;
+    while (offset < fileData.size()) {
+        Packet pkt;
+        pkt.header.type = 2;
+        pkt.header.seqNum = seq++;
+        size_t chunkSize = min((size_t)DATA_SIZE, fileData.size() - offset);
+        pkt.header.length = chunkSize;
+        pkt.data.insert(pkt.data.end(), fileData.begin()+offset, fileData.begin()+offset+chunkSize);
+        PacketHeader temp = pkt.header;
+        temp.checksum = 0;
+        pkt.header.checksum = crc32(&temp, HEADER_SIZE) ^ crc32(pkt.data.data(), pkt.data.size());
+        pkt.acked = false;
+        packets.push_back(pkt);
+        offset += chunkSize;
+    }
+    if (!last)
+        packets.push_back(makeControlPacket(4, seq++));
+    return true;
+}
+
 int main(int argc, char* argv[]) {
     string hostname;
     int port = 0, windowSize = 0;
-    string inputFile, logFile;
+    vector<string> inputs;
+    string listFile, logFile;
+    SocketOptions sockOpts;
     
     // Parse command-line arguments
     int opt;
-    while ((opt = getopt(argc, argv, "h:p:w:i:o:")) != -1) {
+    while ((opt = getopt(argc, argv, "h:p:w:i:l:o:" SOCKET_OPTION_FLAGS)) != -1) {
         switch(opt) {
             case 'h': hostname = optarg; break;
             case 'p': port = atoi(optarg); break;
             case 'w': windowSize = atoi(optarg); break;
-            case 'i': inputFile = optarg; break;
+            case 'i': inputs.push_back(optarg); break;
+            case 'l': listFile = optarg; break;
             case 'o': logFile = optarg; break;
             default:
-                cerr << "Usage: ./wSender -h <hostname> -p <port> -w <window-size> -i <input-file> -o <output-log>\n";
+                if (parseSocketOption(opt, optarg, sockOpts))
+                    break;
+                cerr << "Usage: ./wSender -h <hostname> -p <port> -w <window-size> -i <input-file|dir> [-i ...] [-l <input-list>] -o <output-log> " SOCKET_OPTION_USAGE "\n";
                 return 1;
         }
     }
-    
-    // Read input file into memory
-    ifstream infile(inputFile, ios::binary);
-    if (!infile) {
-        cerr << "Error opening input file\n";
+    if (windowSize <= 0) {
+        cerr << "Window size must be positive\n";
         return 1;
     }
-    vector<char> fileData((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
-    infile.close();
+    
+    // Every file named by -i (or -l) is sent back to back over one connection
+    vector<string> files;
+    if (!collectInputFiles(inputs, listFile, files))
+        return 1;
     
     // Create UDP socket
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -74,6 +129,10 @@ int main(int argc, char* argv[]) {
     servAddr.sin_family = AF_INET;
     servAddr.sin_port = htons(port);
     inet_pton(AF_INET, hostname.c_str(), &servAddr.sin_addr);
+    applySocketOptions(sock, sockOpts, windowSize);
+    cpu_set_t otherCpus;
+    pinIoThread(sockOpts, &otherCpus);
+    uint32_t drops = 0;
     
     // Open log file for writing
     ofstream logfile(logFile);
@@ -82,121 +141,76 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
-    vector<Packet> packets;
-    // Create START packet (type 0) with a random seqNum
-    Packet startPkt;
-    startPkt.header.type = 0;
-    startPkt.header.seqNum = rand() % 10000;
-    startPkt.header.length = 0;
-    startPkt.header.checksum = crc32(&startPkt.header, HEADER_SIZE - sizeof(uint32_t));
-    startPkt.acked = false;
-    packets.push_back(startPkt);
-    
-    // Create DATA packets (type 2)
-    uint32_t seq = 0; // data packets start at 0
-    size_t offset = 0;
-    while(offset < fileData.size()) {
-        Packet pkt;
-        pkt.header.type = 2;
-        pkt.header.seqNum = seq++;
-        size_t chunkSize = min((size_t)DATA_SIZE, fileData.size() - offset);
-        pkt.header.length = chunkSize;
-        pkt.data.insert(pkt.data.end(), fileData.begin()+offset, fileData.begin()+offset+chunkSize);
-        PacketHeader temp = pkt.header;
-        temp.checksum = 0;
-        // For DATA packets we combine checksum over header and data
-        pkt.header.checksum = crc32(&temp, HEADER_SIZE) ^ crc32(pkt.data.data(), pkt.data.size());
-        pkt.acked = false;
-        packets.push_back(pkt);
-        offset += chunkSize;
-    }
-    
-    // Create END packet (type 1) with same seqNum as START packet
-    Packet endPkt;
-    endPkt.header.type = 1;
-    endPkt.header.seqNum = packets[0].header.seqNum;
-    endPkt.header.length = 0;
-    endPkt.header.checksum = crc32(&endPkt.header, HEADER_SIZE - sizeof(uint32_t));
-    endPkt.acked = false;
-    packets.push_back(endPkt);
+    // Create START packet (type 0) with a random seqNum, different on every run
+    // and clear of the DATA seqNums (see pickStartSeq)
+    uint64_t packetCount;
+    if (!countSessionPackets(files, DATA_SIZE, packetCount))
+        return 1;
+    random_device rd;
+    Packet startPkt = makeControlPacket(0, pickStartSeq(rd, 0, packetCount));
     
-    // --- Send START packet and wait for its ACK ---
-    sendto(sock, &packets[0].header, HEADER_SIZE, 0, (sockaddr*)&servAddr, sizeof(servAddr));
-    logPacket(logfile, packets[0].header);
+    // --- Send START packet and wait for its ACK, retransmitting on timeout ---
     char ackBuffer[MAX_PACKET_SIZE];
     sockaddr_in fromAddr;
     socklen_t fromLen = sizeof(fromAddr);
-    // Wait (with timeout) for ACK of the START packet
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(sock, &readfds);
-    timeval tv = {0, 500000}; // 500ms timeout
-    if (select(sock+1, &readfds, NULL, NULL, &tv) > 0) {
-        recvfrom(sock, ackBuffer, MAX_PACKET_SIZE, 0, (sockaddr*)&fromAddr, &fromLen);
-        PacketHeader ack;
-        memcpy(&ack, ackBuffer, HEADER_SIZE);
-        if (ack.type == 3 && ack.seqNum == packets[0].header.seqNum)
-            packets[0].acked = true;
-        logPacket(logfile, ack);
-    } else {
-        // retransmit if timeout
-        sendto(sock, &packets[0].header, HEADER_SIZE, 0, (sockaddr*)&servAddr, sizeof(servAddr));
-        logPacket(logfile, packets[0].header);
+    sendPacket(sock, servAddr, startPkt, logfile);
+    while (!startPkt.acked) {
+        if (waitReadable(sock, TIMEOUT_MS * 1000, sockOpts.spin)) {
+            ssize_t recvd = recvPacket(sock, ackBuffer, MAX_PACKET_SIZE, &fromAddr, &fromLen, drops);
+            if (recvd < (ssize_t)HEADER_SIZE)
+                continue;
+            PacketHeader ack;
+            memcpy(&ack, ackBuffer, HEADER_SIZE);
+            if (ack.type == 3 && ack.seqNum == startPkt.header.seqNum)
+                startPkt.acked = true;
+            logPacket(logfile, ack);
+        } else {
+            // retransmit if timeout
+            sendPacket(sock, servAddr, startPkt, logfile);
+        }
     }
     
-    // --- Sliding window transfer for DATA and END packets ---
-    size_t base = 1;  // first packet index to be acknowledged (DATA packets start at index 1)
-    size_t next = base;
-    while (base < packets.size()) {
-        // Send new packets within the window
-        while (next < packets.size() && next < base + windowSize) {
-            if (!packets[next].acked) {
-                sendto(sock, &packets[next].header, HEADER_SIZE, 0, (sockaddr*)&servAddr, sizeof(servAddr));
-                if (packets[next].header.type == 2 && !packets[next].data.empty())
-                    sendto(sock, packets[next].data.data(), packets[next].data.size(), 0, (sockaddr*)&servAddr, sizeof(servAddr));
-                packets[next].sendTime = steady_clock::now();
-                logPacket(logfile, packets[next].header);
+    // --- Sliding window transfer for DATA, EOF and END packets ---
+    // Cumulative ACKs; on timeout the whole window is retransmitted (see SenderWindow.hpp).
+    // DATA packets are built one file at a time so the next file starts filling
+    // the window while the previous file's tail is still unacknowledged
+    SenderWindow window(windowSize, false, milliseconds(TIMEOUT_MS));
+    auto transmit = [&](Packet &pkt) { sendPacket(sock, servAddr, pkt, logfile); };
+    uint32_t seq = 0; // data packets start at 0
+    size_t fileIdx = 0;
+    bool endQueued = false;
+    while (true) {
+        while (!endQueued && window.hasRoom()) {
+            if (fileIdx < files.size()) {
+                if (!appendFilePackets(window.packets, files[fileIdx], seq, fileIdx + 1 == files.size()))
+                    return 1;
+                fileIdx++;
+            } else {
+                // Create END packet (type 1) with same seqNum as START packet
+                window.packets.push_back(makeControlPacket(1, startPkt.header.seqNum));
+                endQueued = true;
             }
-            next++;
         }
-        // Wait for ACKs with timeout
-        FD_ZERO(&readfds);
-        FD_SET(sock, &readfds);
-        tv.tv_sec = 0; tv.tv_usec = 500000;
-        if (select(sock+1, &readfds, NULL, NULL, &tv) > 0) {
-            ssize_t recvd = recvfrom(sock, ackBuffer, MAX_PACKET_SIZE, 0, (sockaddr*)&fromAddr, &fromLen);
+        if (window.drained())
+            break;
+        
+        window.sendNew(steady_clock::now(), transmit);
+        // Wait for ACKs until the window's timer is due
+        if (waitReadable(sock, window.waitMicros(steady_clock::now()), sockOpts.spin)) {
+            ssize_t recvd = recvPacket(sock, ackBuffer, MAX_PACKET_SIZE, &fromAddr, &fromLen, drops);
             if (recvd >= (ssize_t)HEADER_SIZE) {
                 PacketHeader ack;
                 memcpy(&ack, ackBuffer, HEADER_SIZE);
-                if (ack.type == 3) {
-                    // Cumulative ACK: mark all data packets with seqNum less than ack.seqNum as acknowledged.
-                    for (size_t i = base; i < packets.size(); i++) {
-                        if (packets[i].header.type == 2 && packets[i].header.seqNum < ack.seqNum)
-                            packets[i].acked = true;
-                    }
-                    // Also check END packet
-                    if (packets.back().header.seqNum == ack.seqNum)
-                        packets.back().acked = true;
-                }
+                if (ack.type == 3)
+                    window.onAck(ack.seqNum, steady_clock::now());
                 logPacket(logfile, ack);
-                // Slide the window forward
-                while (base < packets.size() && packets[base].acked)
-                    base++;
-            }
-        } else {
-            // Timeout: retransmit all packets in the current window
-            for (size_t i = base; i < next; i++) {
-                if (!packets[i].acked) {
-                    sendto(sock, &packets[i].header, HEADER_SIZE, 0, (sockaddr*)&servAddr, sizeof(servAddr));
-                    if (packets[i].header.type == 2 && !packets[i].data.empty())
-                        sendto(sock, packets[i].data.data(), packets[i].data.size(), 0, (sockaddr*)&servAddr, sizeof(servAddr));
-                    packets[i].sendTime = steady_clock::now();
-                    logPacket(logfile, packets[i].header);
-                }
             }
         }
+        // Timeout: retransmit all packets in the current window
+        window.onTimer(steady_clock::now(), transmit);
     }
     
+    cerr << "Kernel dropped " << drops << " incoming datagrams (SO_RXQ_OVFL)\n";
     close(sock);
     logfile.close();
     return 0;
@@ -1,10 +1,20 @@
+#include "common/Checkpoint.hpp"
 #include "common/Crc32.hpp"
+#include "common/InputFiles.hpp"
+#include "common/Lz.hpp"
 #include "common/PacketHeader.hpp"
+#include "common/SenderWindow.hpp"
+#include "common/SocketOptions.hpp"
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <random>
+#include <memory>
 #include <cstring>
 #include <cstdlib>
 #include <arpa/inet.h>
@@ -12,6 +22,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <algorithm>
+#include <sys/stat.h>
 
 using namespace std;
 using namespace std::chrono;
@@ -20,46 +31,291 @@ using namespace std::chrono;
 #define HEADER_SIZE sizeof(PacketHeader)
 #define DATA_SIZE (MAX_PACKET_SIZE - HEADER_SIZE)
 #define TIMEOUT_MS 500
-
-struct Packet {
-    PacketHeader header;
-    vector<char> data;
-    steady_clock::time_point sendTime;
-    bool acked;
-};
+#define RESUME_IDLE_MS 5000 // silence after which a resumable sender redoes the handshake
+#define GIVE_UP_IDLE_MS 30000 // silence after which any other sender gives up
+#define COMPRESS_BLOCK_PACKETS 16 // packets worth of file data compressed together
+#define SOURCE_QUEUE_PACKETS 4096 // packets the worker may prepare ahead of the send loop
 
 void logPacket(ofstream &logfile, const PacketHeader &header) {
     logfile << header.type << " " << header.seqNum << " " << header.length << " " << header.checksum << "\n";
     logfile.flush();
 }
 
+// The checksum covers the header and any payload
+void sealPacket(Packet &pkt) {
+    pkt.header.length = pkt.data.size();
+    pkt.header.checksum = 0;
+    pkt.header.checksum = crc32(&pkt.header, HEADER_SIZE) ^ crc32(pkt.data.data(), pkt.data.size());
+    pkt.acked = false;
+}
+
+Packet makeControlPacket(uint32_t type, uint32_t seqNum) {
+    Packet pkt;
+    pkt.header.type = type;
+    pkt.header.seqNum = seqNum;
+    sealPacket(pkt);
+    return pkt;
+}
+
+// Identifies a set of input files across sender runs, so a resumed START can be
+// matched with the receiver's checkpoint. Never 0, which means "no resume".
+// False if a file can no longer be read.
+bool transferIdFor(const vector<string> &files, uint32_t &id) {
+    string key;
+    for (const string &path : files) {
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0) {
+            cerr << "Error opening input file " << path << "\n";
+            return false;
+        }
+        key += path + '\0' + to_string((long long)st.st_size) + '\0' + to_string((long long)st.st_mtime) + '\0';
+    }
+    id = crc32(key.data(), key.size());
+    if (!id)
+        id = 1;
+    return true;
+}
+
+// Header and data go out in a single datagram
+void sendPacket(int sock, const sockaddr_in &servAddr, Packet &pkt, ofstream &logfile) {
+    char buffer[MAX_PACKET_SIZE];
+    memcpy(buffer, &pkt.header, HEADER_SIZE);
+    if (!pkt.data.empty())
+        memcpy(buffer + HEADER_SIZE, pkt.data.data(), pkt.data.size());
+    sendto(sock, buffer, HEADER_SIZE + pkt.data.size(), 0, (const sockaddr*)&servAddr, sizeof(servAddr));
+    logPacket(logfile, pkt.header);
+}
+
+// Reads the input files on a worker thread and turns them into sealed DATA,
+// ZDATA and EOF packets, followed by an EOF between files. With compression on,
+// each block of COMPRESS_BLOCK_PACKETS packets is sent compressed only if that
+// saves at least one packet. The send loop only takes packets that are already
+// prepared, so file I/O and compression never stall it. Packets the receiver
+// already holds (after a resume) are numbered but never queued.
+class PacketSource {
+public:
+    // workerCpus, if given, keeps the worker off the CPU the I/O thread is pinned to
+    PacketSource(const vector<string> &files, const ResumeState &resume, bool compress, const cpu_set_t *workerCpus)
+        : files(files), resume(resume), compress(compress), seq(0), done(false), failed(false), stopping(false) {
+        if (workerCpus)
+            this->workerCpus = *workerCpus;
+        else
+            CPU_ZERO(&this->workerCpus);
+        worker = thread(&PacketSource::run, this);
+    }
+
+    ~PacketSource() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        notFull.notify_all();
+        worker.join();
+    }
+
+    // Take the next prepared packet without waiting
+    bool tryPop(Packet &pkt) {
+        lock_guard<mutex> lock(mtx);
+        if (queue.empty())
+            return false;
+        pkt = std::move(queue.front());
+        queue.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // Every packet has been produced and taken
+    bool exhausted() {
+        lock_guard<mutex> lock(mtx);
+        return done && !failed && queue.empty();
+    }
+
+    bool hasFailed() {
+        lock_guard<mutex> lock(mtx);
+        return failed;
+    }
+
+private:
+    void run() {
+        if (CPU_COUNT(&workerCpus))
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &workerCpus);
+        bool ok = true;
+        for (size_t i = 0; ok && i < files.size(); i++)
+            ok = produceFile(files[i], i + 1 == files.size());
+        lock_guard<mutex> lock(mtx);
+        failed = !ok && !stopping;
+        done = true;
+    }
+
+    bool produceFile(const string &path, bool last) {
+        struct stat st;
+        ifstream infile(path, ios::binary);
+        if (!infile || stat(path.c_str(), &st) < 0) {
+            cerr << "Error opening input file " << path << "\n";
+            return false;
+        }
+        // Without compression the packet count is known up front, so a file the
+        // receiver already has in full is not read at all
+        if (!compress) {
+            uint64_t count = (st.st_size + DATA_SIZE - 1) / DATA_SIZE + (last ? 0 : 1);
+            if (seq + count <= resume.expectedSeq) {
+                seq += count;
+                return true;
+            }
+        }
+
+        vector<char> block(COMPRESS_BLOCK_PACKETS * DATA_SIZE);
+        while (true) {
+            infile.read(block.data(), block.size());
+            size_t got = infile.gcount();
+            if (got > 0 && !produceBlock(block.data(), got))
+                return false;
+            if (got < block.size())
+                break;
+        }
+        return last || emit(4, NULL, 0);
+    }
+
+    bool produceBlock(const char *raw, size_t len) {
+        size_t rawPackets = (len + DATA_SIZE - 1) / DATA_SIZE;
+        if (compress && rawPackets > 1) {
+            // The block header and compressed data must fit in fewer packets than the raw data
+            size_t budget = (rawPackets - 1) * DATA_SIZE - ZDATA_BLOCK_HEADER_SIZE;
+            zbuf.resize(ZDATA_BLOCK_HEADER_SIZE + budget);
+            size_t compLen = lzCompress(raw, len, zbuf.data() + ZDATA_BLOCK_HEADER_SIZE, budget);
+            if (compLen) {
+                uint32_t lengths[2] = {(uint32_t)len, (uint32_t)compLen};
+                memcpy(zbuf.data(), lengths, ZDATA_BLOCK_HEADER_SIZE);
+                return emit(5, zbuf.data(), ZDATA_BLOCK_HEADER_SIZE + compLen);
+            }
+        }
+        return emit(2, raw, len);
+    }
+
+    // Split a payload into packets of the given type; EOF has no payload
+    bool emit(uint32_t type, const char *payload, size_t len) {
+        size_t offset = 0;
+        do {
+            size_t chunkSize = min((size_t)DATA_SIZE, len - offset);
+            if (!resume.received(seq)) {
+                Packet pkt;
+                pkt.header.type = type;
+                pkt.header.seqNum = (uint32_t)seq; // the low half; see START_FLAG_SEQ64
+                pkt.data.assign(payload + offset, payload + offset + chunkSize);
+                sealPacket(pkt);
+                if (!push(pkt))
+                    return false;
+            }
+            seq++;
+            offset += chunkSize;
+        } while (offset < len);
+        return true;
+    }
+
+    // Blocks while the queue is full; false once the source is being torn down
+    bool push(Packet &pkt) {
+        unique_lock<mutex> lock(mtx);
+        notFull.wait(lock, [this] { return queue.size() < SOURCE_QUEUE_PACKETS || stopping; });
+        if (stopping)
+            return false;
+        queue.push_back(std::move(pkt));
+        return true;
+    }
+
+    vector<string> files;
+    ResumeState resume;
+    bool compress;
+    uint64_t seq; // packet number; it only wraps on the wire
+    vector<char> zbuf;
+    cpu_set_t workerCpus;
+
+    mutex mtx;
+    condition_variable notFull;
+    deque<Packet> queue;
+    bool done, failed, stopping;
+    thread worker;
+};
+
+// Send START until it is ACKed. A receiver that understands the START options
+// answers with the flags it accepted, returned in accepted, and its progress,
+// returned in resume if it is for our (nonzero) transferId; a receiver that
+// does not accepts none.
+void handshake(int sock, const sockaddr_in &servAddr, Packet &startPkt, uint32_t transferId, ofstream &logfile,
+               uint32_t &accepted, ResumeState &resume, const SocketOptions &sockOpts, uint32_t &drops) {
+    char ackBuffer[MAX_PACKET_SIZE];
+    sockaddr_in fromAddr;
+    socklen_t fromLen = sizeof(fromAddr);
+    accepted = 0;
+    resume = ResumeState();
+    startPkt.acked = false;
+    sendPacket(sock, servAddr, startPkt, logfile);
+    while (!startPkt.acked) {
+        if (waitReadable(sock, TIMEOUT_MS * 1000, sockOpts.spin)) {
+            ssize_t recvd = recvPacket(sock, ackBuffer, MAX_PACKET_SIZE, &fromAddr, &fromLen, drops);
+            if (recvd < (ssize_t)HEADER_SIZE)
+                continue;
+            PacketHeader ack;
+            memcpy(&ack, ackBuffer, HEADER_SIZE);
+            logPacket(logfile, ack);
+            if (ack.type != 3 || ack.seqNum != startPkt.header.seqNum)
+                continue;
+            if (ack.length > 0) {
+                // [transfer id][accepted flags][resume state]
+                PacketHeader temp = ack;
+                temp.checksum = 0;
+                uint32_t prefix[2];
+                if (ack.length > (size_t)recvd - HEADER_SIZE || ack.length < sizeof(prefix) ||
+                    (crc32(&temp, HEADER_SIZE) ^ crc32(ackBuffer + HEADER_SIZE, ack.length)) != ack.checksum ||
+                    !decodeResumeState(ackBuffer + HEADER_SIZE + sizeof(prefix), ack.length - sizeof(prefix), resume))
+                    continue;
+                memcpy(prefix, ackBuffer + HEADER_SIZE, sizeof(prefix));
+                accepted = prefix[1];
+                if (transferId == 0 || prefix[0] != transferId)
+                    resume = ResumeState(); // not our transfer's progress: send everything
+            }
+            startPkt.acked = true;
+        } else {
+            sendPacket(sock, servAddr, startPkt, logfile);
+        }
+    }
+}
+
 int main(int argc, char* argv[]) {
     string hostname;
     int port = 0, windowSize = 0;
-    string inputFile, logFile;
-    
+    vector<string> inputs;
+    string listFile, logFile;
+    bool resumable = false, compress = false;
+    SocketOptions sockOpts;
+
     int opt;
-    while ((opt = getopt(argc, argv, "h:p:w:i:o:")) != -1) {
+    while ((opt = getopt(argc, argv, "h:p:w:i:l:o:rz" SOCKET_OPTION_FLAGS)) != -1) {
         switch(opt) {
             case 'h': hostname = optarg; break;
             case 'p': port = atoi(optarg); break;
             case 'w': windowSize = atoi(optarg); break;
-            case 'i': inputFile = optarg; break;
+            case 'i': inputs.push_back(optarg); break;
+            case 'l': listFile = optarg; break;
             case 'o': logFile = optarg; break;
+            case 'r': resumable = true; break;
+            case 'z': compress = true; break;
             default:
-                cerr << "Usage: ./wSenderOpt -h <hostname> -p <port> -w <window-size> -i <input-file> -o <output-log>\n";
+                if (parseSocketOption(opt, optarg, sockOpts))
+                    break;
+                cerr << "Usage: ./wSenderOpt -h <hostname> -p <port> -w <window-size> -i <input-file|dir> [-i ...] [-l <input-list>] -o <output-log> [-r] [-z] " SOCKET_OPTION_USAGE "\n";
                 return 1;
         }
     }
-    
-    ifstream infile(inputFile, ios::binary);
-    if (!infile) {
-        cerr << "Error opening input file\n";
+    if (windowSize <= 0) {
+        cerr << "Window size must be positive\n";
         return 1;
     }
-    vector<char> fileData((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
-    infile.close();
-    
+
+    // Every file named by -i (or -l) is sent back to back over one connection
+    vector<string> files;
+    if (!collectInputFiles(inputs, listFile, files))
+        return 1;
+
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
         perror("socket");
@@ -70,116 +326,125 @@ int main(int argc, char* argv[]) {
     servAddr.sin_family = AF_INET;
     servAddr.sin_port = htons(port);
     inet_pton(AF_INET, hostname.c_str(), &servAddr.sin_addr);
-    
+    applySocketOptions(sock, sockOpts, windowSize);
+    cpu_set_t otherCpus;
+    bool pinned = pinIoThread(sockOpts, &otherCpus);
+    if (pinned)
+        CPU_CLR(sockOpts.cpu, &otherCpus);
+    uint32_t drops = 0;
+
     ofstream logfile(logFile);
     if (!logfile) {
         cerr << "Error opening log file\n";
         return 1;
     }
-    
-    vector<Packet> packets;
-    // START packet
+
+    // START packet, carrying the transfer id (with -r, for resume) and option flags if needed
     Packet startPkt;
     startPkt.header.type = 0;
-    startPkt.header.seqNum = rand() % 10000;
-    startPkt.header.length = 0;
-    startPkt.header.checksum = crc32(&startPkt.header, HEADER_SIZE - sizeof(uint32_t));
-    startPkt.acked = false;
-    packets.push_back(startPkt);
-    
-    // DATA packets
-    uint32_t seq = 0;
-    size_t offset = 0;
-    while(offset < fileData.size()) {
-        Packet pkt;
-        pkt.header.type = 2;
-        pkt.header.seqNum = seq++;
-        size_t chunkSize = min((size_t)DATA_SIZE, fileData.size() - offset);
-        pkt.header.length = chunkSize;
-        pkt.data.insert(pkt.data.end(), fileData.begin()+offset, fileData.begin()+offset+chunkSize);
-        PacketHeader temp = pkt.header;
-        temp.checksum = 0;
-        pkt.header.checksum = crc32(&temp, HEADER_SIZE) ^ crc32(pkt.data.data(), pkt.data.size());
-        pkt.acked = false;
-        packets.push_back(pkt);
-        offset += chunkSize;
-    }
-    
-    // END packet
-    Packet endPkt;
-    endPkt.header.type = 1;
-    endPkt.header.seqNum = packets[0].header.seqNum;
-    endPkt.header.length = 0;
-    endPkt.header.checksum = crc32(&endPkt.header, HEADER_SIZE - sizeof(uint32_t));
-    endPkt.acked = false;
-    packets.push_back(endPkt);
-    
-    // --- Send START packet and wait for individual ACK ---
-    sendto(sock, &packets[0].header, HEADER_SIZE, 0, (sockaddr*)&servAddr, sizeof(servAddr));
-    logPacket(logfile, packets[0].header);
+    // Past 2^32 packets seqNum wraps, which only a receiver that accepts
+    // START_FLAG_SEQ64 can follow. Compression only ever needs fewer.
+    uint64_t packetCount;
+    if (!countSessionPackets(files, DATA_SIZE, packetCount))
+        return 1;
+    random_device rd;
+    startPkt.header.seqNum = pickStartSeq(rd, 0, packetCount); // different on every run
+    uint32_t transferId = 0;
+    if (resumable && !transferIdFor(files, transferId))
+        return 1;
+    uint32_t options[2] = {transferId,
+                           (uint32_t)((packetCount > UINT32_MAX ? START_FLAG_SEQ64 : 0) | (compress ? START_FLAG_COMPRESS : 0))};
+    // Without any option START stays as the README has it, for any receiver
+    if (options[0] || options[1])
+        startPkt.data.assign((const char*)options, (const char*)options + sizeof(options));
+    sealPacket(startPkt);
+
     char ackBuffer[MAX_PACKET_SIZE];
     sockaddr_in fromAddr;
     socklen_t fromLen = sizeof(fromAddr);
-    recvfrom(sock, ackBuffer, MAX_PACKET_SIZE, 0, (sockaddr*)&fromAddr, &fromLen);
-    PacketHeader ack;
-    memcpy(&ack, ackBuffer, HEADER_SIZE);
-    if (ack.type == 3 && ack.seqNum == packets[0].header.seqNum)
-        packets[0].acked = true;
-    logPacket(logfile, ack);
-    
-    size_t base = 1, next = base;
-    while (base < packets.size()) {
-        // Send packets in window
-        while (next < packets.size() && next < base + windowSize) {
-            if (!packets[next].acked) {
-                sendto(sock, &packets[next].header, HEADER_SIZE, 0, (sockaddr*)&servAddr, sizeof(servAddr));
-                if (packets[next].header.type == 2 && !packets[next].data.empty())
-                    sendto(sock, packets[next].data.data(), packets[next].data.size(), 0, (sockaddr*)&servAddr, sizeof(servAddr));
-                packets[next].sendTime = steady_clock::now();
-                logPacket(logfile, packets[next].header);
-            }
-            next++;
+    ResumeState resume;
+    bool finished = false;
+    while (!finished) {
+        // --- Send START packet and wait for individual ACK ---
+        // Use only the options the receiver confirmed it understands
+        uint32_t accepted;
+        handshake(sock, servAddr, startPkt, options[0], logfile, accepted, resume, sockOpts, drops);
+        if (!(accepted & START_FLAG_SEQ64) && packetCount > UINT32_MAX) {
+            cerr << "Receiver does not support 64-bit sequence numbers, needed for " << packetCount << " packets\n";
+            return 1;
         }
-        
-        // Wait for individual ACKs
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(sock, &readfds);
-        timeval tv = {0, 500000};
-        if (select(sock+1, &readfds, NULL, NULL, &tv) > 0) {
-            ssize_t recvd = recvfrom(sock, ackBuffer, MAX_PACKET_SIZE, 0, (sockaddr*)&fromAddr, &fromLen);
-            if (recvd >= (ssize_t)HEADER_SIZE) {
-                PacketHeader ackPkt;
-                memcpy(&ackPkt, ackBuffer, HEADER_SIZE);
-                if (ackPkt.type == 3) {
-                    // In the optimized version, each ACK acknowledges one packet (its seqNum)
-                    for (size_t i = base; i < packets.size(); i++) {
-                        if (packets[i].header.seqNum == ackPkt.seqNum)
-                            packets[i].acked = true;
-                    }
+
+        // Packets are prepared on a worker thread, so the next file starts filling
+        // the window while the previous file's tail is still unacknowledged. After a
+        // resume the pipeline is rebuilt from the first file, minus what the
+        // receiver reported it already holds.
+        unique_ptr<PacketSource> source(new PacketSource(files, resume, accepted & START_FLAG_COMPRESS, pinned ? &otherCpus : NULL));
+        // Selective ACKs with a timer per packet (see SenderWindow.hpp)
+        SenderWindow window(windowSize, true, milliseconds(TIMEOUT_MS));
+        auto transmit = [&](Packet &pkt) { sendPacket(sock, servAddr, pkt, logfile); };
+        bool endQueued = false;
+        auto lastAck = steady_clock::now();
+        while (true) {
+            while (!endQueued && window.hasRoom()) {
+                Packet pkt;
+                if (source->tryPop(pkt)) {
+                    window.packets.push_back(std::move(pkt));
+                } else if (source->exhausted()) {
+                    // END packet
+                    window.packets.push_back(makeControlPacket(1, startPkt.header.seqNum));
+                    endQueued = true;
+                } else {
+                    break; // the worker is still preparing packets; send what is ready
                 }
-                logPacket(logfile, ackPkt);
             }
-        }
-        
-        // Check per-packet timers and retransmit those that have timed out
-        auto now = steady_clock::now();
-        for (size_t i = base; i < next; i++) {
-            if (!packets[i].acked) {
-                auto elapsed = duration_cast<milliseconds>(now - packets[i].sendTime).count();
-                if (elapsed >= TIMEOUT_MS) {
-                    sendto(sock, &packets[i].header, HEADER_SIZE, 0, (sockaddr*)&servAddr, sizeof(servAddr));
-                    if (packets[i].header.type == 2 && !packets[i].data.empty())
-                        sendto(sock, packets[i].data.data(), packets[i].data.size(), 0, (sockaddr*)&servAddr, sizeof(servAddr));
-                    packets[i].sendTime = steady_clock::now();
-                    logPacket(logfile, packets[i].header);
+            if (source->hasFailed())
+                return 1;
+            if (endQueued && window.drained()) {
+                finished = true;
+                break;
+            }
+
+            window.sendNew(steady_clock::now(), transmit);
+
+            // Wait for individual ACKs until the next timer is due, only briefly if
+            // the window has room the worker is about to fill
+            long waitUs = window.waitMicros(steady_clock::now());
+            if (!endQueued && window.hasRoom())
+                waitUs = min(waitUs, 1000L);
+            if (waitReadable(sock, waitUs, sockOpts.spin)) {
+                ssize_t recvd = recvPacket(sock, ackBuffer, MAX_PACKET_SIZE, &fromAddr, &fromLen, drops);
+                if (recvd >= (ssize_t)HEADER_SIZE) {
+                    PacketHeader ackPkt;
+                    memcpy(&ackPkt, ackBuffer, HEADER_SIZE);
+                    // ACKs with a payload answer a START and acknowledge no DATA
+                    if (ackPkt.type == 3 && ackPkt.length == 0) {
+                        lastAck = steady_clock::now();
+                        window.onAck(ackPkt.seqNum, lastAck);
+                    }
+                    logPacket(logfile, ackPkt);
                 }
             }
+
+            // Retransmit the packets whose timers have run out
+            auto now = steady_clock::now();
+            window.onTimer(now, transmit);
+
+            // A receiver that has gone quiet may have restarted and forgotten the
+            // connection; handshake again and continue from its checkpoint
+            if (window.idle())
+                lastAck = now;
+            if (resumable && duration_cast<milliseconds>(now - lastAck).count() >= RESUME_IDLE_MS)
+                break;
+            // Without -r there is nothing to resume: a receiver that abandoned the
+            // transfer never ACKs again
+            if (!resumable && duration_cast<milliseconds>(now - lastAck).count() >= GIVE_UP_IDLE_MS) {
+                cerr << "No ACK for " << GIVE_UP_IDLE_MS / 1000 << " s; giving up\n";
+                return 1;
+            }
         }
-        while (base < packets.size() && packets[base].acked)
-            base++;
     }
-    
+
+    cerr << "Kernel dropped " << drops << " incoming datagrams (SO_RXQ_OVFL)\n";
     close(sock);
     logfile.close();
     return 0;
@@ -0,0 +1,343 @@
+#include "common/Connection.hpp"
+#include "common/PacketHeader.hpp"
+#include "common/ReceiveWindow.hpp"
+#include "common/SenderWindow.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <getopt.h>
+#include <algorithm>
+
+using namespace std;
+using namespace std::chrono;
+
+// Discrete-event simulation of a WTP transfer: the sender and receiver windows
+// of wSender/wReceiver ("base") or wSenderOpt/wReceiverOpt ("opt") exchange
+// headers over a simulated link with loss, reordering and duplication. Time is
+// virtual, so a transfer that takes minutes of 500 ms timeouts on a real
+// network runs in microseconds, and a given seed always replays the same run.
+
+#define MAX_PACKET_SIZE 1472
+#define HEADER_SIZE sizeof(PacketHeader)
+#define DATA_SIZE (MAX_PACKET_SIZE - HEADER_SIZE)
+#define TIMEOUT_MS 500
+#define SIM_LIMIT_S 3600 // virtual time after which a transfer counts as stuck
+#define SIM_PEER 1       // peerKey of the one simulated sender
+
+typedef SenderWindow::TimePoint TimePoint;
+
+struct Scenario {
+    bool selective;
+    uint32_t windowSize;
+    uint32_t packets;     // DATA packets in the transfer
+    uint64_t firstSeq;    // packet number of the first; the protocol starts at 0, but a run
+                          // that starts just short of 2^32 exercises the seqNum wrap
+    double loss;          // per packet, in each direction
+    double reorder;       // chance a packet is held back by up to jitter
+    double duplicate;     // chance a packet is delivered twice
+    nanoseconds delay;    // one-way propagation delay
+    nanoseconds jitter;
+    double mbps;          // bottleneck rate in each direction
+    uint64_t seed;
+};
+
+struct Result {
+    bool completed = false;   // the sender saw END ACKed
+    uint32_t delivered = 0;   // DATA packets the receiver delivered in order
+    double seconds = 0;       // virtual time until END was ACKed
+    uint64_t transmissions = 0, retransmissions = 0;
+};
+
+// A header arriving at one end of the link
+struct Event {
+    TimePoint when;
+    uint64_t order; // ties are broken in send order, so a seed always replays the same run
+    bool toReceiver;
+    PacketHeader header;
+};
+
+struct LaterEvent {
+    bool operator()(const Event &a, const Event &b) const {
+        return a.when != b.when ? a.when > b.when : a.order > b.order;
+    }
+};
+
+// The receiver keeps nothing but the seqNum order per packet
+struct Segment {
+    uint32_t type;
+};
+
+class Simulation {
+public:
+    explicit Simulation(const Scenario &sc)
+        : sc(sc), rng(sc.seed), window(sc.windowSize, sc.selective, milliseconds(TIMEOUT_MS)),
+          receiveWindow(sc.windowSize, sc.selective) {
+        linkFree[0] = linkFree[1] = TimePoint();
+    }
+
+    Result run() {
+        Result result;
+        startSeq = pickStartSeq(rng, (uint32_t)sc.firstSeq, sc.packets);
+        sendStart();
+        while (!result.completed && now - TimePoint() < seconds(SIM_LIMIT_S)) {
+            TimePoint due = started ? window.deadline() : startDeadline;
+            if (events.empty() && due == TimePoint::max())
+                break;
+            if (!events.empty() && events.top().when <= due) {
+                Event ev = events.top();
+                events.pop();
+                now = ev.when;
+                if (ev.toReceiver)
+                    receiverGot(ev.header);
+                else
+                    senderGot(ev.header);
+            } else if (started) {
+                now = due;
+                window.onTimer(now, [this](Packet &pkt) { transmit(pkt.header, true); });
+            } else {
+                now = due;
+                sendStart();
+                startResent++;
+            }
+            if (started)
+                result.completed = senderStep();
+        }
+        result.delivered = delivered;
+        result.seconds = duration<double>(now - TimePoint()).count();
+        result.transmissions = window.transmissions + startResent + 1;
+        result.retransmissions = window.retransmissions + startResent;
+        return result;
+    }
+
+private:
+    void sendStart() {
+        PacketHeader header = {0, startSeq, 0, 0};
+        transmit(header, true);
+        startDeadline = now + milliseconds(TIMEOUT_MS);
+    }
+
+    // The sender's main loop: queue DATA and END while the window has room, then
+    // send what fits. True once END is ACKed.
+    bool senderStep() {
+        while (!endQueued && window.hasRoom()) {
+            Packet pkt;
+            pkt.acked = false;
+            if (queued < sc.packets) {
+                uint32_t length = queued + 1 < sc.packets ? DATA_SIZE : DATA_SIZE / 2;
+                pkt.header = {2, (uint32_t)(sc.firstSeq + queued++), length, 0};
+            } else {
+                pkt.header = {1, startSeq, 0, 0};
+                endQueued = true;
+            }
+            window.packets.push_back(pkt);
+        }
+        if (endQueued && window.drained())
+            return true;
+        window.sendNew(now, [this](Packet &pkt) { transmit(pkt.header, true); });
+        return false;
+    }
+
+    void senderGot(const PacketHeader &ack) {
+        if (ack.type != 3)
+            return;
+        if (!started)
+            started = ack.seqNum == startSeq;
+        else
+            window.onAck(ack.seqNum, now);
+    }
+
+    // The receivers' main loop, on the same connection and window logic
+    void receiverGot(const PacketHeader &header) {
+        if (header.type == 0) {
+            ConnectionAction action = connection.onStart(header.seqNum, 0, SIM_PEER);
+            if (action == CONNECTION_IGNORE)
+                return;
+            if (action == CONNECTION_OPEN) {
+                connection.open(header.seqNum, 0, SIM_PEER);
+                receiveWindow = ReceiveWindow<Segment>(sc.windowSize, sc.selective);
+                receiveWindow.expectedSeq = sc.firstSeq;
+            }
+            sendAck(header.seqNum);
+        } else if (header.type == 2 && connection.active) {
+            if (!receiveWindow.answers(header.seqNum))
+                return;
+            if (receiveWindow.wants(header.seqNum)) {
+                Segment seg = {header.type};
+                receiveWindow.store(receiveWindow.position(header.seqNum), seg);
+            }
+            uint64_t seq;
+            Segment seg;
+            while (receiveWindow.pop(seq, seg)) {
+                if (seq == sc.firstSeq + delivered)
+                    delivered++;
+            }
+            sendAck(receiveWindow.ackFor(header.seqNum));
+        } else if (header.type == 1) {
+            ConnectionAction action = connection.onEnd(header.seqNum, SIM_PEER);
+            if (action == CONNECTION_IGNORE)
+                return;
+            if (action == CONNECTION_CLOSE)
+                connection.close();
+            sendAck(header.seqNum);
+        }
+    }
+
+    void sendAck(uint32_t seqNum) {
+        PacketHeader ack = {3, seqNum, 0, 0};
+        transmit(ack, false);
+    }
+
+    // Each direction is a bottleneck of sc.mbps followed by sc.delay. A packet
+    // may be lost, held back by up to sc.jitter (and so reordered), or duplicated.
+    void transmit(const PacketHeader &header, bool toReceiver) {
+        TimePoint &free = linkFree[toReceiver];
+        free = max(now, free) + nanoseconds((long long)((HEADER_SIZE + header.length) * 8 * 1000 / sc.mbps));
+        if (chance(sc.loss))
+            return;
+        int copies = chance(sc.duplicate) ? 2 : 1;
+        for (int i = 0; i < copies; i++) {
+            TimePoint when = free + sc.delay;
+            if (chance(sc.reorder))
+                when += nanoseconds((long long)(unit(rng) * sc.jitter.count()));
+            Event ev = {when, order++, toReceiver, header};
+            events.push(ev);
+        }
+    }
+
+    bool chance(double p) { return p > 0 && unit(rng) < p; }
+
+    Scenario sc;
+    mt19937_64 rng;
+    uniform_real_distribution<double> unit;
+    priority_queue<Event, vector<Event>, LaterEvent> events;
+    uint64_t order = 0;
+    TimePoint now;
+    TimePoint linkFree[2]; // when each direction's bottleneck is next idle
+
+    // Sender
+    SenderWindow window;
+    uint32_t startSeq = 0;
+    bool started = false;
+    TimePoint startDeadline;
+    uint64_t startResent = 0;
+    uint32_t queued = 0;
+    bool endQueued = false;
+
+    // Receiver
+    ReceiverConnection connection;
+    ReceiveWindow<Segment> receiveWindow;
+    uint32_t delivered = 0;
+};
+
+vector<string> splitList(const string &arg) {
+    vector<string> items;
+    stringstream ss(arg);
+    string item;
+    while (getline(ss, item, ','))
+        items.push_back(item);
+    return items;
+}
+
+int main(int argc, char* argv[]) {
+    vector<string> modes(1, "opt");
+    vector<string> windows(1, "16"), losses(1, "0.01"), reorders(1, "0.05");
+    Scenario base;
+    base.packets = 1000;
+    base.firstSeq = 0;
+    base.duplicate = 0;
+    base.delay = milliseconds(10);
+    base.jitter = milliseconds(20);
+    base.mbps = 100;
+    uint64_t seed = 1;
+    int runs = 100;
+    string outFile;
+
+    // Every combination of the comma-separated lists is run with seeds seed .. seed + runs - 1
+    int opt;
+    while ((opt = getopt(argc, argv, "m:w:l:r:n:s:p:q:d:t:j:b:o:")) != -1) {
+        switch(opt) {
+            case 'm': modes = splitList(optarg); break;
+            case 'w': windows = splitList(optarg); break;
+            case 'l': losses = splitList(optarg); break;
+            case 'r': reorders = splitList(optarg); break;
+            case 'n': runs = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'p': base.packets = atoi(optarg); break;
+            case 'q': base.firstSeq = strtoull(optarg, NULL, 10); break;
+            case 'd': base.duplicate = atof(optarg); break;
+            case 't': base.delay = microseconds((long long)(atof(optarg) * 1000)); break;
+            case 'j': base.jitter = microseconds((long long)(atof(optarg) * 1000)); break;
+            case 'b': base.mbps = atof(optarg); break;
+            case 'o': outFile = optarg; break;
+            default:
+                cerr << "Usage: ./wtpSim [-m base,opt] [-w <window-sizes>] [-l <loss-rates>] [-r <reorder-rates>] [-n <runs>] [-s <seed>]"
+                        " [-p <packets>] [-q <first-packet-number>] [-d <duplicate-rate>] [-t <delay-ms>] [-j <jitter-ms>] [-b <mbit/s>] [-o <results.csv>]\n";
+                return 1;
+        }
+    }
+    for (size_t i = 0; i < modes.size(); i++) {
+        if (modes[i] != "base" && modes[i] != "opt") {
+            cerr << "Unknown mode " << modes[i] << " (base or opt)\n";
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < windows.size(); i++) {
+        if (atoi(windows[i].c_str()) <= 0) {
+            cerr << "Window size must be positive\n";
+            return 1;
+        }
+    }
+    if (base.mbps <= 0) {
+        cerr << "Link rate must be positive\n";
+        return 1;
+    }
+
+    ofstream outfile;
+    if (!outFile.empty()) {
+        outfile.open(outFile);
+        if (!outfile) {
+            cerr << "Error opening output file\n";
+            return 1;
+        }
+    }
+    ostream &out = outFile.empty() ? cout : outfile;
+    out << "mode,window,packets,loss,reorder,duplicate,seed,completed,delivered,seconds,transmissions,retransmissions\n";
+
+    uint64_t scenarios = 0, stuck = 0, lost = 0;
+    auto wallStart = steady_clock::now();
+    for (const string &mode : modes) {
+        for (const string &w : windows) {
+            for (const string &l : losses) {
+                for (const string &r : reorders) {
+                    for (int i = 0; i < runs; i++) {
+                        Scenario sc = base;
+                        sc.selective = mode == "opt";
+                        sc.windowSize = atoi(w.c_str());
+                        sc.loss = atof(l.c_str());
+                        sc.reorder = atof(r.c_str());
+                        sc.seed = seed + i;
+                        Result res = Simulation(sc).run();
+                        out << mode << "," << sc.windowSize << "," << sc.packets << "," << sc.loss << "," << sc.reorder
+                            << "," << sc.duplicate << "," << sc.seed << "," << res.completed << "," << res.delivered
+                            << "," << res.seconds << "," << res.transmissions << "," << res.retransmissions << "\n";
+                        scenarios++;
+                        if (!res.completed)
+                            stuck++;
+                        else if (res.delivered != sc.packets)
+                            lost++;
+                    }
+                }
+            }
+        }
+    }
+    double wall = duration<double>(steady_clock::now() - wallStart).count();
+    cerr << scenarios << " scenarios in " << wall << " s (" << (wall > 0 ? scenarios / wall : 0) << " per second); "
+         << stuck << " did not finish within " << SIM_LIMIT_S << " s, " << lost << " finished without delivering every packet\n";
+    return stuck || lost ? 2 : 0;
+}